@@ -1,9 +1,17 @@
 // [[Rcpp::depends(RcppArmadillo)]]
 
 
+#include "alloc_count.h"
 #include <RcppArmadillo.h>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <vector>
 #include "utils.h"
 #include "toolbox.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 using namespace arma;
 using namespace Rcpp;
 
@@ -24,6 +32,238 @@ using namespace Rcpp;
 //   return(y);
 // }
 
+// Draw factors given data and parameters. Sampling follows Durbin and Koopman 2002/2012. The draw
+// is left in ws.Zd.
+void DrawFactors(DrawWork& ws,
+                 const arma::mat& B,
+                 const arma::sp_mat& Jb,
+                 const arma::mat& q,
+                 const arma::mat& H,
+                 const arma::vec& R,
+                 const arma::mat& Y,
+                 const arma::uvec& freq,
+                 const arma::uvec& LD,
+                 const ObsPatterns& pat, // patterns of missing values in Y
+                 rng_stream& rng){
+  // Simulate, then smooth the data less the simulated data, in one routine. R is diagonal so
+  // observations are processed one at a time, or collapsed to the size of the state when there are
+  // more series than states.
+  bool collapse = H.n_rows > Jb.n_cols;
+  ws.Rd.zeros(R.n_elem, R.n_elem);
+  ws.Rd.diag() = R;
+  SimSmooth(ws, B, Jb, q, H, ws.Rd, Y, freq, LD, !collapse, collapse, pat, rng);
+}
+
+// Series whose loadings are drawn on the same factors: the same frequency and differencing, and on
+// the same side of the normalization (the first m series). Observed periods differ little across
+// series in a group, so each group has a base set of periods, those observed by at least half of
+// its series, and each series records where its own periods differ from the base.
+struct LoadGroups{
+  arma::field<arma::uvec> series;  // series in each group
+  arma::field<arma::uvec> base;    // base periods of each group
+  arma::uvec norm;                 // 1 if the group's series normalize the factors
+  arma::uvec group;                // group of each series
+  arma::field<arma::uvec> obs;     // periods observed by each series
+  arma::field<arma::uvec> add;     // periods observed by each series but not in its base
+  arma::field<arma::uvec> drop;    // base periods not observed by each series
+};
+
+LoadGroups load_groups(const arma::mat& Ytmp,
+                       const arma::uvec& freq,
+                       const arma::uvec& LD,
+                       arma::uword m){
+  uword T = Ytmp.n_rows;
+  uword k = Ytmp.n_cols;
+  std::map<std::vector<uword>,uword> keys;
+  LoadGroups lg;
+  lg.group.set_size(k);
+  for(uword j = 0; j < k; j++){
+    std::vector<uword> key = {j < m, freq(j), LD(j)};
+    lg.group(j) = keys.insert(std::make_pair(key, keys.size())).first->second;
+  }
+  uword G = keys.size();
+  lg.series.set_size(G);
+  lg.base.set_size(G);
+  lg.norm.set_size(G);
+  lg.obs.set_size(k);
+  lg.add.set_size(k);
+  lg.drop.set_size(k);
+  umat observed(T, k, fill::zeros);
+  observed.elem(find_finite(Ytmp)).ones();
+  for(uword g = 0; g < G; g++){
+    lg.series(g) = find(lg.group == g);
+    lg.norm(g)   = lg.series(g)(0) < m;
+    uvec in_base = 2*sum(observed.cols(lg.series(g)), 1) >= lg.series(g).n_elem;
+    lg.base(g)   = find(in_base);
+    for(uword j : lg.series(g)){
+      lg.obs(j)  = find(observed.col(j));
+      lg.add(j)  = find(observed.col(j) > in_base);
+      lg.drop(j) = find(observed.col(j) < in_base);
+    }
+  }
+  return(lg);
+}
+
+// Draw loadings (rows of Hout) and variances of shocks R for series in groups with lg.norm == norm,
+// given factors Z.rows(t0, t0+T-1). Series are independent given the factors, so they are drawn in
+// parallel. Each series draws from its own stream seeded by (seed, series), so draws do not depend
+// on the number of threads.
+//
+// The posterior precision xx'xx + Lam_H is found once per group over its base periods. Series that
+// differ from the base in a few periods correct it with those rows of xx, and only series that
+// differ in more periods than they observe build it from scratch.
+void DrawLoadings(arma::mat& Hout,
+                  arma::vec& R,
+                  const arma::mat& Z,
+                  arma::uword t0,
+                  const LoadGroups& lg,
+                  arma::uword norm,
+                  const arma::mat& Hp,
+                  const arma::mat& Lam_H,
+                  const arma::vec& nu_r,
+                  const arma::mat& Ytmp,
+                  const MFCache& mf,
+                  arma::uword seed){
+  uword T  = Ytmp.n_rows;
+  uword k  = Ytmp.n_cols;
+  uword G  = lg.series.n_elem;
+  field<mat> xx(G), P(G), U(G);
+  std::string err;
+
+  //regressors for all periods, posterior precision over the base periods and its Cholesky factor
+#pragma omp parallel for schedule(dynamic)
+  for(uword g = 0; g < G; g++){
+    if(lg.norm(g) != norm) continue;
+    try{
+      xx(g)   = mf_ZJt(Z, t0, T, mf.agg[mf.id(lg.series(g)(0))]);
+      mat Xb  = xx(g).rows(lg.base(g));
+      P(g)    = trans(Xb)*Xb+Lam_H;
+      P(g)    = (trans(P(g))+P(g))/2;
+      U(g)    = chol(P(g));
+    } catch(std::exception& e){
+#pragma omp critical
+      err = e.what();
+    }
+  }
+  if(!err.empty()){
+    throw std::runtime_error(err);
+  }
+
+  //draws for each series in these groups
+#pragma omp parallel for schedule(dynamic)
+  for(uword j = 0; j < k; j++){
+    uword g = lg.group(j);
+    if(lg.norm(g) != norm) continue;
+    try{
+      std::seed_seq seq{std::uint32_t(seed), std::uint32_t(std::uint64_t(seed) >> 32), std::uint32_t(j)};
+      rng_stream rng(seq);
+      const uvec& ind = lg.obs(j);
+      mat Xo = xx(g).rows(ind);
+      mat Uj;
+      bool ok = false;
+      if(lg.add(j).is_empty() && lg.drop(j).is_empty()){
+        Uj = U(g);
+        ok = true;
+      }else if(lg.add(j).n_elem + lg.drop(j).n_elem < ind.n_elem){
+        mat Xa = xx(g).rows(lg.add(j));
+        mat Xd = xx(g).rows(lg.drop(j));
+        mat Pj = P(g) + trans(Xa)*Xa - trans(Xd)*Xd;
+        ok     = chol(Uj, (trans(Pj)+Pj)/2);
+      }
+      if(!ok){ //differs from the base in many periods, or the correction lost precision
+        mat Pj = trans(Xo)*Xo+Lam_H;
+        Uj     = chol((trans(Pj)+Pj)/2);
+      }
+      vec Yt     = Ytmp.col(j);
+      vec yy     = Yt(ind);                    //LHS variable
+      vec h      = trans(Hp.row(j));           //prior mean
+      vec mu     = chol_solve(Uj, trans(Xo)*yy+Lam_H*h);
+      vec e      = yy-Xo*mu;
+      double scl = 1 + dot(e,e) + as_scalar(trans(mu-h)*Lam_H*(mu-h)); // prior scale is the 1, the rest comes from the posterior
+      R(j)       = invchisq(nu_r(j)+yy.n_elem,scl,rng); //Draw for r
+      Hout.row(j) = trans(mvrnrm_chol(1, mu, Uj, R(j), rng).col(0));
+    } catch(std::exception& e){
+#pragma omp critical
+      err = e.what();
+    }
+  }
+  if(!err.empty()){
+    throw std::runtime_error(err);
+  }
+}
+
+// Draw parameters given factors in ws.Zd. B, q, H, and R are updated in place. Returns false
+// if no stationary draw for B is found. Rejected draws of B, and draws that needed the eigenvalues
+// of the companion matrix to settle stationarity, are added to n_reject and n_eigen.
+bool DrawParms(arma::mat& B,
+               arma::mat& q,
+               arma::mat& H,
+               arma::vec& R,
+               DrawWork& ws,          // factors in ws.Zd, including initial values
+               const arma::mat& Bp,
+               const arma::sp_mat& Jb,
+               const arma::mat& Lam_B,
+               double nu_q,
+               const arma::mat& Hp,
+               const arma::mat& Lam_H,
+               const arma::vec& nu_r,
+               const arma::mat& Ytmp,   // data with initial values shed
+               const LoadGroups& lg,    // series sharing regressors
+               const MFCache& mf,       // aggregation of the factors for each series
+               arma::uword& n_reject,
+               arma::uword& n_eigen,
+               rng_stream& rng){
+
+  uword m  = B.n_rows;
+  uword p  = Jb.n_cols/m;
+  uword T  = Ytmp.n_rows; //periods once initial values are shed
+
+  mat U, Lq, Mu, scale, xx, yy;
+  mat Ht(m,m,fill::zeros);
+  bool stat;
+
+  // For H, M, and R
+
+  //For observations used to normalize (initial values of Zd are not used)
+  uword seed = rng();
+  DrawLoadings(Ht, R, ws.Zd, p, lg, 1, Hp, Lam_H, nu_r, Ytmp, mf, seed);
+
+  //Rotate and scale the factors to fit our normalization for H
+  ws.Zr    = ws.Zd.rows(p,p+T-1)*kron(eye<mat>(p,p),trans(Ht));
+
+  //For observations not used to normalize
+  DrawLoadings(H, R, ws.Zr, 0, lg, 0, Hp, Lam_H, nu_r, Ytmp, mf, seed);
+
+  // For B and q
+
+  yy    = ws.Zr(span(1,T-1),span(0,m-1));
+  xx    = ws.Zr.rows(0,T-2)*trans(Jb);
+  U     = trans(xx)*xx+Lam_B;    //posterior precision
+  U     = chol((trans(U)+U)/2);   //and its Cholesky factor
+  Mu    = chol_solve(U, trans(xx)*yy+Lam_B*trans(Bp));
+  scale = eye(m,m)+trans(yy-xx*Mu)*(yy-xx*Mu)+trans(Mu-trans(Bp))*Lam_B*(Mu-trans(Bp)); // eye(k) is the prior scale parameter for the IW distribution and eye(k)+junk the posterior.
+  scale = (scale+trans(scale))/2;
+  q     = rinvwish(1,nu_q+T,scale,rng); //Draw for q
+  Lq    = chol(q, "lower");
+  uword count_reps = 1;
+  do{ //this loop ensures the fraw for B is stationary --- non stationary draws are rejected
+    // vectorise(B) ~ N(vectorise(Mu'), kron(inv(xx'xx+Lam_B), q)), drawn as a matrix normal
+    B     = mnrnrm_chol(trans(Mu), U, Lq, rng); //Draw for B
+    // Check wheter B is stationary and reject if not
+    stat  = !B.has_nan() && stationary(B, n_eigen);
+    n_reject += !stat;
+    if(count_reps == 10000 && master_thread()){
+      Rcpp::Rcout << "Draws Non-Stationary" << endl;
+    }
+    if(count_reps == 30000 || B.has_nan()){
+      return(false); //break program if still no stationary draws
+    }
+    count_reps = count_reps+1;
+  } while(!stat);
+
+  return(true);
+}
+
 // [[Rcpp::export]]
 List EstDFM(      arma::mat B,     // transition matrix
                   arma::mat Bp,    // prior for B
@@ -39,18 +279,19 @@ List EstDFM(      arma::mat B,     // transition matrix
                   arma::mat Y,     // data
                   arma::uvec freq, // frequency denoted as number of high frequency periods in a low frequency period
                   arma::uvec LD,  // 0 for level data and 1 for first difference
+                  arma::uword seed, // seed for the chains' RNG streams; callers draw it from R's RNG
                   bool store_Y = false, //Store distribution of Y?
                   arma::uword store_idx = 0, // index to store distribution of predicted values
                   arma::uword reps = 1000, //repetitions
-                  arma::uword burn = 500,
-                  bool verbose = false){ //burn in periods
-
-  // preliminaries
+                  arma::uword burn = 500,  //burn in periods
+                  bool verbose = false,
+                  arma::uword chains = 1,  // number of independent chains, run in parallel
+                  arma::uword thin = 1,    // keep every thin-th draw after burn in
+                  bool store_draws = true){ // store draws, or only keep streaming estimates of medians
 
   // preliminaries
   uword m  = B.n_rows;
   uword p  = Jb.n_cols/m;
-  uword T  = Y.n_rows - p;
   uword k  = H.n_rows;
   uword sA    = m*p; // size A matrix
   uword sB    = B.n_cols; // columns of transition matrix B
@@ -61,285 +302,171 @@ List EstDFM(      arma::mat B,     // transition matrix
   //mat Bp(m,sA, fill::zeros);  //prior for B
   //mat Hp(k,m,fill::zeros); //prior for M and H (treated as the same parameters)
 
-  // Initialize variables
-  mat v_1, V_1, mu, Mu, Beta, scale, xx, yy, Zd, Zs, Zsim, Yd, Ys, Rmat;
-  mat Ht(m,m,fill::zeros), aa;
-  sp_mat Jh;
-  vec Yt;
-  uvec ind;
-  uword count_reps;
-  double scl;
-  double ev = 2;
-  cube Bstore(m,sB,reps); //store draws for B
-  cube Hstore(k,m,reps);  //store draws for H
-  cube Qstore(m,m,reps);  //store draws for Q
-  mat  Rstore(k,reps);    //R is diagonal so only diagonals stored (hence matrix not cube)
+  if(chains == 0 || chains > reps){
+    stop("Number of chains must be between 1 and reps");
+  }
+  if(thin == 0){
+    stop("thin must be at least 1");
+  }
+
+  // Without stored draws memory does not depend on reps: each chain keeps a P^2 sketch of the
+  // median of B, H, q, R (and Y) stacked in one vector, and the sketches are merged at the end
+  uword n_keep = reps*store_draws;
+  cube Bstore(m,sB,n_keep); //store draws for B
+  cube Hstore(k,m,n_keep);  //store draws for H
+  cube Qstore(m,m,n_keep);  //store draws for Q
+  mat  Rstore(k,n_keep);    //R is diagonal so only diagonals stored (hence matrix not cube)
   mat  Ystore;
   vec  Y_median;
   if(store_Y){
-    Ystore = zeros<mat>(Y.n_rows, reps);
+    Ystore = zeros<mat>(Y.n_rows, n_keep);
     Y_median = zeros<vec>(Y.n_rows);
   }
+  uword n_sketch = m*sB + k*m + m*m + k + store_Y*Y.n_rows;
+  std::vector<P2Quantile> sketch(store_draws ? 0 : chains, p2_init(n_sketch, 0.5));
+  MFCache mf = mf_cache(freq, LD, m, sA); //aggregation of the factors for each series
+  sp_mat Jy  = mf.agg[mf.id(store_idx)].J;
   List Out;
-  field<mat> FSim;
-
-  vec eigval;
-  mat eigvec;
-  cx_vec eigval_cx;
-  cx_mat eigvec_cx;
 
   mat Ytmp = Y;
   Ytmp.shed_rows(0,p-1); //shed initial values to match Z
 
-  for(uword rep = 0; rep<burn; rep++){
-
-    Rcpp::checkUserInterrupt();
-
-    if(verbose){
-      Rcpp::Rcout << "\rProgress: " << round(100*rep/(burn + reps)) << "% (burning)";
-    }
-
-    // --------- Sample Factors given Data and Parameters ---------
-
-    // Sampling follows Durbin and Koopman 2002/2012
-
-    Rmat  = diagmat(R); // Make a matrix out of R to plug in to DSimMF
-    // Draw observations Y^star and Z^star
-    FSim  = FSimMF(B, Jb, q, H, Rmat, Y, freq, LD);
-    Zd    = FSim(0); //draw for Z
-    Yd    = FSim(1); //draw for Y
-    Ys    = Y-Yd;
-    // Smooth using Ys (i.e. Y^star)
-    Zs    = DSMF(B, Jb, q, H, Rmat, Ys, freq, LD);
-    Zsim  = Zs + Zd; // Draw for factors
-
-    Zsim.shed_rows(0,p-1); //shed initial values (not essential)
-
-    // -------- Sample Parameters given Factors -------
-
-    // For H, M, and R
-
-    //For observations used to normalize
-    for(uword j=0; j<m; j++){ //loop over variables
-      Yt   = Ytmp.col(j);
-      ind  = find_finite(Yt);   //find non-missing values
-      yy   = Yt(ind);         //LHS variable
-      Jh = J_MF(freq(j), m, LD(j), sA);
-      xx = Zsim.rows(ind)*trans(Jh);
-      V_1   = trans(xx)*xx+Lam_H;
-      V_1   = (trans(V_1)+V_1)/2;
-      V_1   = inv_sympd(V_1);
-      mu    = V_1*(trans(xx)*yy+Lam_H*trans(Hp.row(j)));
-      scl   = 1 + as_scalar(trans(yy-xx*mu)*(yy-xx*mu)+trans(mu-trans(Hp.row(j)))*Lam_H*(mu-trans(Hp.row(j)))); // prior scale is the 1, + as_scalar(junk) comes from the posterior
-      R(j)  = invchisq(nu_r(j)+yy.n_elem,scl); //Draw for r
-      Beta  = mvrnrm(1, mu, V_1*R(j));
-      Ht.row(j) = trans(Beta.col(0));
-      //H.row(j) = trans(Beta.col(0));
-    }
-
-    //Rotate and scale the factors to fit our normalization for H
-    Zsim     = Zsim*kron(eye<mat>(p,p),trans(Ht));
-
-    //For observations not used to normalize
-    for(uword j=m; j<k; j++){ //loop over variables
-      Yt   = Ytmp.col(j);
-      ind  = find_finite(Yt);   //find non-missing values
-      yy   = Yt(ind);         //LHS variable
-      Jh = J_MF(freq(j), m, LD(j), sA);
-      xx = Zsim.rows(ind)*trans(Jh);
-      V_1   = trans(xx)*xx+Lam_H;
-      V_1   = (trans(V_1)+V_1)/2;
-      V_1   = inv_sympd(V_1);
-      mu    = V_1*(trans(xx)*yy+Lam_H*trans(Hp.row(j)));
-      scl   = 1 + as_scalar(trans(yy-xx*mu)*(yy-xx*mu)+trans(mu-trans(Hp.row(j)))*Lam_H*(mu-trans(Hp.row(j)))); // prior scale is the 1, + as_scalar(junk) comes from the posterior
-      R(j)  = invchisq(nu_r(j)+yy.n_elem,scl); //Draw for r
-      Beta  = mvrnrm(1, mu, V_1*R(j));
-      H.row(j) = trans(Beta.col(0));
-    }
-
-    // For B and q
-
-    yy    = Zsim.cols(0,m-1);
-    yy.shed_row(0);
-    xx    = Zsim*trans(Jb);
-    xx.shed_row(T-1);
-    v_1   = trans(xx)*xx+Lam_B;
-    v_1   = (trans(v_1)+v_1)/2;
-    v_1   = inv_sympd(v_1);
-    Mu    = v_1*(trans(xx)*yy+Lam_B*trans(Bp));
-    scale = eye(m,m)+trans(yy-xx*Mu)*(yy-xx*Mu)+trans(Mu-trans(Bp))*Lam_B*(Mu-trans(Bp)); // eye(k) is the prior scale parameter for the IW distribution and eye(k)+junk the posterior.
-    scale = (scale+trans(scale))/2;
-    q     = rinvwish(1,nu_q+T,scale); //Draw for q
-    mu    = vectorise(trans(Mu));  //posterior mean for beta
-    V_1   = kron(v_1,q);  //covariance of vectorized parameters beta
-    ev    = 2;
-    count_reps = 1;
-    do{ //this loop ensures the fraw for B is stationary --- non stationary draws are rejected
-      Beta  = mvrnrm(1,mu,V_1); //Draw for B
-      B     = reshape(Beta,m,sB); //recovering original dimensions
-      // Check wheter B is stationary and reject if not
-      aa      = comp_form(B); //
-      eig_gen(eigval_cx, eigvec_cx, aa);
-      ev     = as_scalar(max(abs(eigval_cx)));
-      Rcpp::checkUserInterrupt();
-      if(count_reps == 10000){
-        Rcpp::Rcout << "Draws Non-Stationary" << endl;
+  // Missing values in Y (and in the simulated Y^star) are the same for every draw
+  ObsPatterns pat = obs_patterns(Y);
+  // Series that share regressors when drawing loadings
+  LoadGroups lg   = load_groups(Ytmp, freq, LD, m);
+
+  // Each chain runs its own burn in and contributes a contiguous block of the stored draws
+  uvec chain_reps(chains);
+  chain_reps.fill(reps/chains);
+  chain_reps.head(reps % chains) += 1;
+  uvec chain_start = cumsum(chain_reps) - chain_reps;
+
+  int n_threads = 1;
+#ifdef _OPENMP
+  n_threads = std::min<int>(chains, omp_get_max_threads());
+#endif
+
+  // Monitoring of the stationarity check for draws of B, for each chain
+  uvec B_accepted(chains, fill::zeros), B_rejected(chains, fill::zeros), B_eigen(chains, fill::zeros);
+
+  //flags are read by every chain, so they are atomic; fail_msg is only written in a critical section
+  std::atomic<bool> interrupted(false);
+  std::atomic<bool> failed(false);
+  std::string fail_msg = "Draws Non-Stationary";
+  mat Zsim;
+
+  // Chains only share the output cubes, and each writes its own slices. Draws depend on
+  // (seed, chain) alone, so results do not change with the number of threads.
+#pragma omp parallel for schedule(static,1) num_threads(n_threads)
+  for(uword c = 0; c < chains; c++){
+
+    std::seed_seq seq{std::uint32_t(seed), std::uint32_t(std::uint64_t(seed) >> 32), std::uint32_t(c)};
+    rng_stream rng(seq);
+    mat Bc = B, qc = q, Hc = H;
+    vec Rc = R;
+    DrawWork ws; //memory for draws of this chain, reused across draws
+    uword draw;
+    uword n_iter = burn + chain_reps(c)*thin;
+    bool  keep;
+    vec   Yd;
+
+    try{
+      for(uword rep = 0; rep < n_iter; rep++){
+
+        if(interrupted || failed) break;
+        if(master_thread()){
+          if(check_interrupt()){
+            interrupted = true;
+            break;
+          }
+          if(verbose && c == 0){
+            if(rep < burn){
+              Rcpp::Rcout << "\rProgress: " << round(100*rep/n_iter) << "% (burning)";
+            }else{
+              Rcpp::Rcout << "\rProgress: " << round(100*rep/n_iter) << "% (sampling)";
+            }
+          }
+        }
+
+        // --------- Sample Factors given Data and Parameters ---------
+
+        DrawFactors(ws, Bc, Jb, qc, Hc, Rc, Y, freq, LD, pat, rng);
+
+        keep = rep >= burn && (rep - burn) % thin == 0;
+        draw = keep ? chain_start(c) + (rep - burn)/thin : 0;
+        if(store_Y && keep){
+          Yd = ws.Zd*trans(Jy)*trans(Hc.row(store_idx));
+          if(store_draws){
+            Ystore.col(draw) = Yd;
+          }
+        }
+
+        // -------- Sample Parameters given Factors -------
+
+        if(!DrawParms(Bc, qc, Hc, Rc, ws, Bp, Jb, Lam_B, nu_q, Hp, Lam_H, nu_r, Ytmp, lg, mf,
+                      B_rejected(c), B_eigen(c), rng)){
+          failed = true;
+          break;
+        }
+        B_accepted(c)++;
+
+        if(keep && store_draws){
+          Bstore.slice(draw) = Bc;
+          Qstore.slice(draw) = qc;
+          Hstore.slice(draw) = Hc;
+          Rstore.col(draw)   = Rc;
+        } else if(keep){
+          p2_add(sketch[c], join_cols(join_cols(vectorise(Bc), vectorise(Hc)),
+                                      join_cols(vectorise(qc), Rc), Yd));
+        }
       }
-      if(count_reps == 30000 || B.has_nan()){
-        throw("Draws Non-Stationary"); //break program if still no stationary draws
+    } catch(std::exception& e){
+#pragma omp critical
+      {
+        failed   = true;
+        fail_msg = e.what();
       }
-      count_reps = count_reps+1;
-    } while(ev>1);
-  }
-
-  // ------------------ Sampling Loop ------------------------------------
-
-  for(uword rep = 0; rep<reps; rep++){
-
-    Rcpp::checkUserInterrupt();
-
-    if(verbose){
-      Rcpp::Rcout << "\rProgress: " << round(100*(burn + rep)/(burn + reps)) << "% (sampling)";
-    }
-
-    // --------- Sample Factors given Data and Parameters
-
-    // Sampling follows Durbin and Koopman 2002/2012
-
-    Rmat  = diagmat(R); // Make a matrix out of R to plug in to DSimMF
-    // Draw observations Y^star and Z^star
-    FSim  = FSimMF(B, Jb, q, H, Rmat, Y, freq, LD);
-    Zd    = FSim(0); //draw for Z
-    Yd    = FSim(1); //draw for Y
-    Ys    = Y-Yd;
-    // Smooth using Ys (i.e. Y^star)
-    Zs    = DSMF(B, Jb, q, H, Rmat, Ys, freq, LD);
-    Zsim  = Zs + Zd; // Draw for factors
-
-    if(store_Y){
-      Jh        = J_MF(freq(store_idx), m, LD(store_idx), sA);
-      //Ystore(t,rep) =  as_scalar(Zsim.row(t)*trans(Jh)*trans(H.row(0)));
-      Ystore.col(rep) = Zsim*trans(Jh)*trans(H.row(store_idx));
-    }
-
-
-    Zsim.shed_rows(0,p-1);
-
-    // -------- Sample Parameters given Factors
-
-    // For H, M, and R
-
-    //For observations used to normalize
-    for(uword j=0; j<m; j++){ //loop over variables
-      Yt   = Ytmp.col(j);
-      ind  = find_finite(Yt);   //find non-missing values
-      yy   = Yt(ind);         //LHS variable
-      Jh = J_MF(freq(j), m, LD(j), sA);
-      xx = Zsim.rows(ind)*trans(Jh);
-      V_1   = trans(xx)*xx+Lam_H;
-      V_1   = (trans(V_1)+V_1)/2;
-      V_1   = inv_sympd(V_1);
-      mu    = V_1*(trans(xx)*yy+Lam_H*trans(Hp.row(j)));
-      scl   = 1 + as_scalar(trans(yy-xx*mu)*(yy-xx*mu)+trans(mu-trans(Hp.row(j)))*Lam_H*(mu-trans(Hp.row(j)))); // prior scale is the 1, + as_scalar(junk) comes from the posterior
-      R(j)  = invchisq(nu_r(j)+yy.n_elem,scl); //Draw for r
-      Beta  = mvrnrm(1, mu, V_1*R(j));
-      Ht.row(j) = trans(Beta.col(0));
-      //H.row(j) = trans(Beta.col(0));
     }
 
-    //Rotate and scale the factors to fit our normalization for H
-    Zsim     = Zsim*kron(eye<mat>(p,p),trans(Ht));
-
-    //For observations not used to normalize
-    for(uword j=m; j<k; j++){ //loop over variables
-      Yt   = Ytmp.col(j);
-      ind  = find_finite(Yt);   //find non-missing values
-      yy   = Yt(ind);         //LHS variable
-      Jh = J_MF(freq(j), m, LD(j), sA);
-      xx = Zsim.rows(ind)*trans(Jh);
-      V_1   = trans(xx)*xx+Lam_H;
-      V_1   = (trans(V_1)+V_1)/2;
-      V_1   = inv_sympd(V_1);
-      mu    = V_1*(trans(xx)*yy+Lam_H*trans(Hp.row(j)));
-      scl   = 1 + as_scalar(trans(yy-xx*mu)*(yy-xx*mu)+trans(mu-trans(Hp.row(j)))*Lam_H*(mu-trans(Hp.row(j)))); // prior scale is the 1, + as_scalar(junk) comes from the posterior
-      R(j)  = invchisq(nu_r(j)+yy.n_elem,scl); //Draw for r
-      Beta  = mvrnrm(1, mu, V_1*R(j));
-      H.row(j) = trans(Beta.col(0));
+    if(c == 0 && !ws.Zr.is_empty()){
+      Zsim = ws.Zr; //last draw of the factors, initial values shed and rotated by H as in DrawParms
     }
+  }
 
-    // For B and q
-
-    yy    = Zsim.cols(0,m-1);
-    yy.shed_row(0);
-    xx    = Zsim*trans(Jb);
-    xx.shed_row(T-1);
-    v_1   = trans(xx)*xx+Lam_B;
-    v_1   = (trans(v_1)+v_1)/2;
-    v_1   = inv_sympd(v_1);
-    Mu    = v_1*(trans(xx)*yy+Lam_B*trans(Bp));
-    scale = eye(m,m)+trans(yy-xx*Mu)*(yy-xx*Mu)+trans(Mu-trans(Bp))*Lam_B*(Mu-trans(Bp)); // eye(k) is the prior scale parameter for the IW distribution and eye(k)+junk the posterior.
-    scale = (scale+trans(scale))/2;
-    q     = rinvwish(1,nu_q+T,scale); //Draw for q
-    mu    = vectorise(trans(Mu));  //posterior mean for beta
-    V_1   = kron(v_1,q);  //covariance of vectorized parameters beta
-    ev    = 2;
-    count_reps = 1;
-    do{ //this loop ensures the fraw for B is stationary --- non stationary draws are rejected
-      Beta  = mvrnrm(1,mu,V_1); //Draw for B
-      B     = reshape(Beta,m,sB); //recovering original dimensions
-      // Check wheter B is stationary and reject if not
-      aa    = comp_form(B); //
-      eig_gen(eigval_cx, eigvec_cx, aa);
-      ev    = as_scalar(max(abs(eigval_cx)));
-      Rcpp::checkUserInterrupt();
-      if(count_reps == 10000){
-        Rcpp::Rcout << "Draws Non-Stationary" << endl;
-      }
-      if(count_reps == 30000){
-        throw("Draws Non-Stationary" || B.has_nan()); //break program if still no stationary draws
-      }
-      count_reps = count_reps+1;
-    } while(ev>1);
-
-    Bstore.slice(rep) = B;
-    Qstore.slice(rep) = q;
-    Hstore.slice(rep) = H;
-    Rstore.col(rep)   = R;
-
+  if(interrupted){
+    throw Rcpp::internal::InterruptedException();
+  }
+  if(failed){
+    stop(fail_msg);
   }
 
   Rcpp::Rcout << "\r                          \r";
 
   //Getting posterior medians
-
-  //For B
-  for(uword rw=0;rw<m;rw++){
-    for(uword cl=0;cl<sB;cl++){
-      B(rw,cl) = as_scalar(median(vectorise(Bstore.tube(rw,cl))));
-    }
-  }
-  //For H
-  for(uword rw=0;rw<k;rw++){
-    for(uword cl=0;cl<m;cl++){
-      H(rw,cl) = as_scalar(median(vectorise(Hstore.tube(rw,cl))));
+  vec med;
+  if(store_draws){
+    //medians across draws of each element, with draws in the columns
+    med = join_cols(join_cols(median(mat(Bstore.memptr(), m*sB, reps, false), 1),
+                              median(mat(Hstore.memptr(), k*m, reps, false), 1)),
+                    join_cols(median(mat(Qstore.memptr(), m*m, reps, false), 1),
+                              median(Rstore, 1)));
+    if(store_Y){
+      Y_median = median(Ystore, 1);
     }
-  }
-  //For q
-  for(uword rw=0;rw<m;rw++){
-    for(uword cl=0;cl<m;cl++){
-      q(rw,cl) = as_scalar(median(vectorise(Qstore.tube(rw,cl))));
+  }else{
+    //median of the pooled draws of all chains, from their sketches
+    med = p2_merge(sketch);
+    if(store_Y){
+      Y_median = med.tail(Y.n_rows);
     }
   }
-  //For R
-  for(uword rw=0;rw<k;rw++){
-    R(rw) = median(Rstore.row(rw));
-  }
-  //For Y
-  if(store_Y){
-    for(uword rw=0;rw<Y.n_rows;rw++){
-      Y_median(rw) = median(Ystore.row(rw));
-    }
-  }else{
+  uword i0 = 0;
+  B  = reshape(med.subvec(i0, i0+m*sB-1), m, sB);  i0 += m*sB;
+  H  = reshape(med.subvec(i0, i0+k*m-1), k, m);    i0 += k*m;
+  q  = reshape(med.subvec(i0, i0+m*m-1), m, m);    i0 += m*m;
+  R  = med.subvec(i0, i0+k-1);
+  if(!store_Y){
     Ystore = zeros<mat>(0,0);
     Y_median = zeros<vec>(0);
   }
@@ -348,17 +475,138 @@ List EstDFM(      arma::mat B,     // transition matrix
   Out["H"]  = H;
   Out["Q"]  = q;
   Out["R"]  = R;
-  Out["Bstore"]  = Bstore;
-  Out["Hstore"]  = Hstore;
-  Out["Qstore"]  = Qstore;
-  Out["Rstore"]  = Rstore;
+  if(store_draws){
+    Out["Bstore"]  = Bstore;
+    Out["Hstore"]  = Hstore;
+    Out["Qstore"]  = Qstore;
+    Out["Rstore"]  = Rstore;
+    Out["Ystore"] = Ystore;
+  }
   Out["Zsim"]  = Zsim;
-  Out["Ystore"] = Ystore;
+  Out["B_accepted"] = B_accepted;
+  Out["B_rejected"] = B_rejected;
+  Out["B_eigen"]    = B_eigen;
   Out["Y_median"] = Y_median;
 
   return(Out);
 }
 
+// Predictive distribution of all series from stored posterior draws of the parameters. For each
+// draw in draws (slices of the stores, from 0) the factors and the shocks to observables are drawn
+// given the data, and the draws of every series are added to P^2 sketches of each quantile in probs,
+// so memory does not depend on the number of draws. If simulate is false the smoothed fitted values
+// of each draw are used instead, giving quantiles of the signal only. Forecast periods are rows of
+// Y that are all missing. Draws are processed in rounds of one per thread, then added to the
+// sketches in the order of draws, so results do not depend on the number of threads. With the
+// default seed the streams are seeded from R's RNG, so set.seed() makes results reproducible.
+// [[Rcpp::export]]
+List PredDFM(     arma::cube Bstore, // draws of the transition matrix
+                  arma::sp_mat Jb,   // helper matrix for transition equation
+                  arma::cube Qstore, // draws of the covariance of shocks to factors
+                  arma::cube Hstore, // draws of the loadings
+                  arma::mat Rstore,  // draws of the variances of shocks to observables
+                  arma::mat Y,       // data
+                  arma::uvec freq,   // frequency of each series
+                  arma::uvec LD,     // 0 for level data and 1 for first difference
+                  arma::uvec draws,  // draws to use
+                  arma::vec probs,   // quantiles to estimate
+                  bool simulate = true,  // draw the factors, or use the smoothed mean of each draw
+                  int seed = -1){ // seed for the draws' RNG streams, drawn from R's RNG if negative
+  uword T  = Y.n_rows;
+  uword k  = Y.n_cols;
+  uword n  = draws.n_elem;
+  uword m  = Bstore.n_rows;
+  uword sA = Jb.n_cols;
+
+  if(n == 0 || draws.max() >= Bstore.n_slices){
+    stop("draws must index slices of the stored draws");
+  }
+  if(Hstore.n_rows != k || Rstore.n_rows != k){
+    stop("Stored draws of H and R must have one row for each series");
+  }
+  if(probs.is_empty() || probs.min() <= 0 || probs.max() >= 1){
+    stop("probs must be between 0 and 1");
+  }
+
+  ObsPatterns pat = obs_patterns(Y);
+  MFCache mf      = mf_cache(freq, LD, m, sA);
+  bool collapse   = k > sA;
+  uword seed0     = seed < 0 ? rng_seed() : (uword)seed;
+  std::vector<P2Quantile> sketch;
+  for(uword i = 0; i < probs.n_elem; i++){
+    sketch.push_back(p2_init(T*k, probs(i)));
+  }
+  mat Ysum(T, k, fill::zeros);
+
+  int n_threads = 1;
+#ifdef _OPENMP
+  n_threads = std::min<int>(n, omp_get_max_threads());
+#endif
+  std::vector<DrawWork> ws(n_threads); //memory for draws, reused across rounds
+  field<mat> Yd(n_threads);
+  bool failed = false;
+  std::string fail_msg;
+
+  for(uword d0 = 0; d0 < n; d0 += n_threads){
+    uword nr = std::min<uword>(n_threads, n - d0);
+
+#pragma omp parallel for schedule(static,1) num_threads(n_threads)
+    for(uword i = 0; i < nr; i++){
+      try{
+        uword d  = draws(d0+i);
+        mat   B  = Bstore.slice(d);
+        mat   q  = Qstore.slice(d);
+        mat   H  = Hstore.slice(d);
+        vec   R  = Rstore.col(d);
+        if(simulate){
+          std::seed_seq seq{std::uint32_t(seed0), std::uint32_t(std::uint64_t(seed0) >> 32), std::uint32_t(d0+i)};
+          rng_stream rng(seq);
+          DrawFactors(ws[i], B, Jb, q, H, R, Y, freq, LD, pat, rng);
+          //shocks to observables, Eps ~ N(0, diag(R)), from the same stream
+          randn_stream(ws[i].U, rng);
+          ws[i].Eps = trans(ws[i].U);
+          ws[i].Eps.each_row() %= trans(sqrt(R));
+          Yd(i) = ws[i].Zd*trans(ws[i].HJ) + ws[i].Eps;
+        }else{
+          Yd(i) = DSMF(B, Jb, q, H, diagmat(R), Y, freq, LD, !collapse, collapse, pat)*trans(mf_HJ(H, mf));
+        }
+      } catch(std::exception& e){
+#pragma omp critical
+        {
+          failed   = true;
+          fail_msg = e.what();
+        }
+      }
+    }
+    if(failed){
+      stop(fail_msg);
+    }
+    if(check_interrupt()){
+      throw Rcpp::internal::InterruptedException();
+    }
+
+    // sketches are independent across quantiles, so they are updated in parallel
+    for(uword i = 0; i < nr; i++){
+      Ysum += Yd(i);
+#pragma omp parallel for num_threads(std::min<int>(n_threads, probs.n_elem))
+      for(uword j = 0; j < probs.n_elem; j++){
+        p2_add(sketch[j], vectorise(Yd(i)));
+      }
+    }
+  }
+
+  cube Yq(T, k, probs.n_elem);
+  for(uword j = 0; j < probs.n_elem; j++){
+    Yq.slice(j) = reshape(p2_get(sketch[j]), T, k);
+  }
+
+  List Out;
+  Out["quantiles"] = Yq;
+  Out["mean"]      = Ysum/n;
+  Out["probs"]     = probs;
+  return(Out);
+}
+
 //-------------------------------------------------
 // --------- Maximum Likelihood Programs ----------
 //-------------------------------------------------
@@ -369,11 +617,23 @@ List Ksmoother(arma::sp_mat A,  // companion form of transition matrix
                arma::sp_mat Q,  // covariance matrix of shocks to states
                arma::sp_mat HJ, // measurement equation
                arma::mat R,     // covariance matrix of shocks to observables; Y are observations
-               arma::mat Y){    //data
+               arma::mat Y,     //data
+               bool univariate = false, // process observations one at a time (R must be diagonal)
+               bool collapse = false){  // collapse observations to the size of the state (R must be diagonal)
   // preliminaries
   uword T  = Y.n_rows;
   uword sA = A.n_rows;
 
+  if(univariate && collapse){
+    stop("Choose at most one of univariate and collapsed filtering");
+  }
+  if((univariate || collapse) && accu(abs(R - diagmat(R))) > 0){
+    stop("Univariate and collapsed filtering require a diagonal R");
+  }
+  ObsPatterns pat = obs_patterns(Y);
+  ObsMats om      = obs_mats(pat, HJ, R, univariate, collapse);
+  Companion Ac    = find_companion(A); //A is applied through its companion structure
+
   // specifying initial values
   mat P0, P1, S, C;
   P0 = 100000*eye<mat>(sA,sA);
@@ -386,34 +646,53 @@ List Ksmoother(arma::sp_mat A,  // companion form of transition matrix
   P1str.slice(0) = P1;
   field<mat> Kstr(T,1);
   field<vec> PEstr(T);
-  mat Z1, VarY, Z, Zp(sA, 1, fill::zeros), Lik, K, G, Rn;
+  mat Z1, VarY, Z, Zp(sA, 1, fill::zeros), Lik, K, G;
   mat Yf = Y;
-  sp_mat Hn;
-  vec PE, Yt, Yn, Yp;
-  uvec ind;
+  vec PE, Yt, Yn, Yp, Zu, Fi;
+  uword j;
   Lik << 0;
   double tmp;
   double tmpp;
   Z.zeros(T,sA);
   Z1.zeros(T+1,sA);
 
+  //For collapsed filtering
+  mat PW;
+  vec Yr, u;
+
   for(uword t=0; t<T; t++) {
     Rcpp::checkUserInterrupt();
     //Allowing for missing Y values
+    j      = pat.id(t); //pattern of missing values in period t
     Yt     = trans(Y.row(t));
-    ind    = find_finite(Yt);
-    Yn     = Yt(ind);
+    Yn     = Yt(pat.ind(j));
     // if nothing is observed
     if(Yn.is_empty()){
       Z.row(t) = trans(Zp);
       P0       = P1;
       P0str.slice(t) = P0;
+    } else if(collapse){
+      Yr     = Yn % om.Ri(j);
+      Zu     = Zp;
+      P0     = P1;
+      Lik    = Lik + CLupdate(Zu, P0, u, PW, om.W(j), trans(om.H(j))*Yr, dot(Yn,Yr), om.ldR(j));
+      PEstr(t)   = Yn - om.H(j)*Zp;
+      Kstr(t,0)  = P0*trans(om.H(j).each_col() % om.Ri(j));
+      Z.row(t)   = trans(Zu);
+      P0str.slice(t) = P0;
+    } else if(univariate){
+      Zu     = Zp;
+      P0     = P1;
+      Lik    = Lik + UVupdate(Zu, P0, K, PE, Fi, om.H(j), om.Rd(j), Yn);
+      //K and PE are sequential; store the multivariate gain and prediction error as for collapsing
+      PEstr(t)   = Yn - om.H(j)*Zp;
+      Kstr(t,0)  = P0*trans(om.H(j).each_col() / om.Rd(j)); //P1*Hn'*S^-1 = P0*Hn'*R^-1
+      Z.row(t)   = trans(Zu);
+      P0str.slice(t) = P0;
     } else {
-      Hn     = sp_rows(HJ,ind);
-      Rn     = R.rows(ind);
-      Rn     = Rn.cols(ind);
+      const mat& Hn = om.H(j);
       Yp     = Hn*Zp; //prediction step for Y
-      S      = Hn*P1*trans(Hn)+Rn; //variance of Yp
+      S      = Hn*P1*trans(Hn)+om.R(j); //variance of Yp
       S      = symmatu((S+trans(S))/2);
       C      = P1*trans(Hn); //covariance of Zp Yp
       K      = trans(solve(S,trans(C))); //Kalman Gain
@@ -428,9 +707,9 @@ List Ksmoother(arma::sp_mat A,  // companion form of transition matrix
       Lik    = -.5*tmp-.5*trans(PE)*solve(S,PE)+Lik;
     }
       //next period variables
-      Zp               = A*trans(Z.row(t)); //prediction for Z(t+1)
+      Zp               = comp_Az(Ac, trans(Z.row(t))); //prediction for Z(t+1)
       Z1.row(t+1)      = trans(Zp);
-      P1               = A*P0*trans(A)+Q; //variance Z(t+1)|Y(1:t)
+      P1               = comp_APA(Ac, P0, Q); //variance Z(t+1)|Y(1:t)
       P1               = (P1+trans(P1))/2;
       P1str.slice(t+1) = P1;
   }
@@ -443,7 +722,7 @@ List Ksmoother(arma::sp_mat A,  // companion form of transition matrix
   //Note indexing starts at 0 so the last period is T-1
 
   for(uword t=T-1; t>0; t = t-1) {
-    G = P0str.slice(t-1)*trans(A)*inv(P1str.slice(t)); //inv_sympd
+    G = trans(comp_AX(Ac, P0str.slice(t-1)))*inv(P1str.slice(t)); //P0*A' = (A*P0)' as P0 is symmetric
     Zs.row(t-1)   = Z.row(t-1) + (Zs.row(t)-Z1.row(t))*trans(G);
     P0            = P0str.slice(t-1)-G*(P1str.slice(t)-Ps.slice(t))*trans(G);
     Ps.slice(t-1) = (P0+trans(P0))/2;
@@ -457,6 +736,7 @@ List Ksmoother(arma::sp_mat A,  // companion form of transition matrix
   Out["Yf"]   = Yf;
   Out["Ys"]   = Yhat;
   Out["Zz"]   = Z;
+  Out["Zp"]   = Z1.rows(0,T-1);
   Out["Z"]    = Zs;
   Out["Kstr"] = Kstr;
   Out["PEstr"]= PEstr;
@@ -465,19 +745,20 @@ List Ksmoother(arma::sp_mat A,  // companion form of transition matrix
   return(Out);
 }
 
-// [[Rcpp::export]]
-List KestExact(arma::sp_mat A,
-               arma::sp_mat Q,
-               arma::mat H,
-               arma::mat R,
-               arma::mat Y,
-               arma::vec itc,
+// Smoother for the model in KestExact, accumulating what EM needs into st. The patterns of missing
+// values in Y are written to pat.
+void em_smooth(EMStats& st,
+               ObsPatterns& pat,
+               const arma::sp_mat& A,
+               const arma::sp_mat& Q,
+               const arma::mat& H,
+               const arma::mat& R,
+               const arma::vec& itc,
+               const arma::mat& Y,
                arma::uword m,
                arma::uword p){
 
-
   uword T  = Y.n_rows;
-  uword k  = Y.n_cols;
 
   // Helper matrix J
 
@@ -490,11 +771,43 @@ List KestExact(arma::sp_mat A,
 
   mat Ytmp  = Y - kron(ones<mat>(T,1),trans(itc));
 
-  List Smth = Ksmoother(A, Q, HJ, R, Ytmp);
+  //R is diagonal. Smoothed variances enter only through sums, which the smoother accumulates.
+  uword sA = A.n_rows;
+  pat        = obs_patterns(Ytmp);
+  ObsMats om = obs_mats(pat, HJ, R, false, true);
+  EMsmooth(st, find_companion(A), Q, 100000*eye<mat>(sA,sA), Ytmp, pat, om, m);
+}
+
+// One EM step for the model in KestExact. Parameters are updated in place, and the smoothed factors
+// under the normalization of the new parameters are written to X. Filtered and predicted factors
+// under the parameters on entry are written to Zz and Zp. Returns the likelihood of the parameters
+// on entry.
+double EMstep(arma::sp_mat& A,
+              arma::sp_mat& Q,
+              arma::mat& H,
+              arma::mat& R,
+              arma::vec& itc,
+              arma::mat& X,
+              arma::mat& Zz,
+              arma::mat& Zp,
+              const arma::mat& Y,
+              arma::uword m,
+              arma::uword p){
+
+  uword T  = Y.n_rows;
+  uword k  = Y.n_cols;
+
+  // Helper matrix J
 
-  mat Z     = Smth["Z"];
-  cube Ps   = Smth["Ps"];
-  mat Lik   = Smth["Lik"];
+  sp_mat J(m,m*(p+1));
+  J(span(0,m-1),span(0,m-1)) = speye<sp_mat>(m,m);
+
+  EMStats st;
+  ObsPatterns pat;
+  em_smooth(st, pat, A, Q, H, R, itc, Y, m, p);
+  const mat& Z = st.Z;
+  Zz = st.Zf;
+  Zp = st.Zp;
 
   mat xx, Zx, axz, XZ, azz, ZZ, axx, tmp, B;
 
@@ -502,14 +815,14 @@ List KestExact(arma::sp_mat A,
 
   xx  = Z.cols(span(0,m-1));
   Zx  = Z.cols(span(m,(p+1)*m-1));
-  axz = sum(Ps(span(0,m-1),span(m,(p+1)*m-1),span::all),2);
+  axz = st.V(span(0,m-1),span(m,(p+1)*m-1));
   XZ  = trans(Zx)*xx + trans(axz);
-  azz = sum(Ps(span(m,(p+1)*m-1),span(m,(p+1)*m-1),span::all),2);
+  azz = st.V(span(m,(p+1)*m-1),span(m,(p+1)*m-1));
   ZZ  = trans(Zx)*Zx + azz;
   B = trans(solve(ZZ,XZ));
   A(span(0,m-1),span(0,m*p-1)) = B;
 
-  axx = sum(Ps(span(0,m-1),span(0,m-1),span::all),2);
+  axx = st.V(span(0,m-1),span(0,m-1));
   mat q = (trans(xx-Zx*trans(B))*(xx-Zx*trans(B)) + axx - axz*trans(B) - B*trans(axz) + B*azz*trans(B) )/T;
 
   Q(span(0,m-1),span(0,m-1))   = q;
@@ -523,18 +836,25 @@ List KestExact(arma::sp_mat A,
 
   xx     =  join_horiz( ones<mat>(T,1), Z*trans(J) ); // ones are for the intercept term
 
+  // sums of J*Ps*J' over the periods each series is observed, from the sums for each pattern
+  field<mat> Vj(k);
+  for(uword j=0; j<k; j++){
+    Vj(j).zeros(m,m);
+  }
+  for(uword g=0; g<pat.ind.n_elem; g++){
+    for(uword j : pat.ind(g)){
+      Vj(j) += st.Vm(g);
+    }
+  }
+
   for(uword j=0; j<k; j++) {
     yy    =  Y.col(j);
     ind   = find_finite(yy);
     y     = yy(ind);
     x     = xx.rows(ind);
     n_elm = y.size();
-    // This section is super clunky... should be able to clean it up somehow but .slices does not accept non-contiguous indexes
     axx   = zeros<mat>(m+1,m+1);
-    for(uword i = 0; i<n_elm; i++){
-      axx(span(1,m),span(1,m))   = J*Ps.slice(ind(i))*trans(J)+axx(span(1,m),span(1,m));
-    }
-    // End clunky bit
+    axx(span(1,m),span(1,m)) = Vj(j);
     XX        = trans(x)*x+axx;
     h         = solve(XX,trans(x)*y);
     itc(j)    = h(0);
@@ -552,7 +872,23 @@ List KestExact(arma::sp_mat A,
   tmp    = kron(eye<mat>(p,p),ThetI)*A(span(0,m*p-1),span(0,m*p-1))*kron(eye<mat>(p,p),Thet);
   A(span(0,m-1),span(0,m*p-1))   = tmp(span(0,m-1),span(0,m*p-1));
   Q(span(0,m-1),span(0,m-1))     = ThetI*Q(span(0,m-1),span(0,m-1))*trans(ThetI);
-  mat X  = Z.cols(0,m-1)*trans(ThetI);
+  X      = Z.cols(0,m-1)*trans(ThetI);
+
+  return(st.lik);
+}
+
+// [[Rcpp::export]]
+List KestExact(arma::sp_mat A,
+               arma::sp_mat Q,
+               arma::mat H,
+               arma::mat R,
+               arma::mat Y,
+               arma::vec itc,
+               arma::uword m,
+               arma::uword p){
+
+  mat X, Zz, Zp;
+  double Lik = EMstep(A, Q, H, R, itc, X, Zz, Zp, Y, m, p);
 
   mat Ys = X*trans(H);
 
@@ -569,6 +905,146 @@ List KestExact(arma::sp_mat A,
   return(Out);
 }
 
+// Parameters of the EM model stacked in a vector: the top rows of A and Q, H, diag(R), and itc
+arma::vec em_pack(const arma::sp_mat& A,
+                  const arma::sp_mat& Q,
+                  const arma::mat& H,
+                  const arma::mat& R,
+                  const arma::vec& itc,
+                  arma::uword m,
+                  arma::uword p){
+  vec th = join_vert(vectorise(mat(A(span(0,m-1),span(0,m*p-1)))),
+                     vectorise(mat(Q(span(0,m-1),span(0,m-1)))));
+  th      = join_vert(th, vectorise(H));
+  th      = join_vert(th, vec(R.diag()));
+  return(join_vert(th, itc));
+}
+
+// Inverse of em_pack. Returns false if R or Q are not positive definite.
+bool em_unpack(arma::sp_mat& A,
+               arma::sp_mat& Q,
+               arma::mat& H,
+               arma::mat& R,
+               arma::vec& itc,
+               const arma::vec& th,
+               arma::uword m,
+               arma::uword p){
+  uword k = H.n_rows;
+  uword n = 0;
+  A(span(0,m-1),span(0,m*p-1)) = reshape(th.subvec(n, n+m*m*p-1), m, m*p);
+  n += m*m*p;
+  mat q = reshape(th.subvec(n, n+m*m-1), m, m);
+  Q(span(0,m-1),span(0,m-1)) = q;
+  n += m*m;
+  H = reshape(th.subvec(n, n+k*m-1), k, m);
+  n += k*m;
+  R.diag() = th.subvec(n, n+k-1);
+  n += k;
+  itc = th.subvec(n, n+k-1);
+  mat Lq;
+  return(all(R.diag() > 0) && chol(Lq, (q+trans(q))/2));
+}
+
+// EM estimation of the model in KestExact, iterating in place until the relative change in the
+// likelihood, 200*(L1-L0)/|L1+L0|, is below tol (after at least 5 iterations) or max_iter
+// iterations. With accelerate = true each iteration is a SQUAREM step (Varadhan and Roland 2008):
+// two EM steps give the direction, the parameters are extrapolated along it, and one more EM step
+// stabilises the result. The extrapolation is dropped, keeping the parameters after the two EM
+// steps, if it leaves R or Q not positive definite or if the likelihood at the extrapolated
+// parameters is below the likelihood at the parameters after the first of the two EM steps. Lik,
+// X, Zz and Zp all come from one final pass of the smoother under the parameters returned.
+// [[Rcpp::export]]
+List EMdfm(arma::sp_mat A,
+           arma::sp_mat Q,
+           arma::mat H,
+           arma::mat R,
+           arma::mat Y,
+           arma::vec itc,
+           arma::uword m,
+           arma::uword p,
+           double tol = 0.01,
+           arma::uword max_iter = 1000,
+           bool accelerate = false,
+           bool verbose = false){
+
+  mat X, Zz, Zp;
+  vec th0, th1, th2, r, v;
+  double Lik0 = -1e10, Lik1 = 0, Lik2, Lik_x, alpha, Conv;
+  uword count = 0, n_steps = 0;
+  bool converged = false;
+
+  while(count < max_iter){
+    Rcpp::checkUserInterrupt();
+    if(accelerate){
+      th0  = em_pack(A, Q, H, R, itc, m, p);
+      EMstep(A, Q, H, R, itc, X, Zz, Zp, Y, m, p);
+      th1  = em_pack(A, Q, H, R, itc, m, p);
+      Lik2 = EMstep(A, Q, H, R, itc, X, Zz, Zp, Y, m, p); //likelihood of th1
+      th2  = em_pack(A, Q, H, R, itc, m, p);
+      n_steps += 2;
+      Lik1  = Lik2;
+      r     = th1 - th0;
+      v     = th2 - 2*th1 + th0;
+      alpha = norm(v) > 0 ? std::min(-norm(r)/norm(v), -1.0) : -1;
+      //alpha = -1 extrapolates to th2 itself, where the parameters already are
+      if(alpha < -1){
+        if(em_unpack(A, Q, H, R, itc, th0 - 2*alpha*r + alpha*alpha*v, m, p)){
+          Lik_x = EMstep(A, Q, H, R, itc, X, Zz, Zp, Y, m, p);
+          n_steps++;
+          if(Lik_x < Lik2){
+            em_unpack(A, Q, H, R, itc, th2, m, p);
+          }else{
+            Lik1 = Lik_x;
+          }
+        }else{
+          em_unpack(A, Q, H, R, itc, th2, m, p);
+        }
+      }
+    }else{
+      Lik1 = EMstep(A, Q, H, R, itc, X, Zz, Zp, Y, m, p);
+      n_steps++;
+    }
+    if(verbose){
+      Rcpp::Rcout << "Likelihood: " << Lik1 << endl;
+    }
+    Conv  = 200*(Lik1-Lik0)/std::abs(Lik1+Lik0);
+    Lik0  = Lik1;
+    count++;
+    if(Conv <= tol && count >= 5){
+      converged = true;
+      break;
+    }
+  }
+
+  //the likelihoods above are of the parameters each EM step started from, and X, Zz and Zp of the
+  //last EM step were smoothed under those, so all outputs are taken from a pass under the final ones
+  EMStats st;
+  ObsPatterns pat;
+  em_smooth(st, pat, A, Q, H, R, itc, Y, m, p);
+  X  = st.Z.cols(0,m-1);
+  Zz = st.Zf;
+  Zp = st.Zp;
+
+  mat Ys = X*trans(H);
+
+  List Out;
+  Out["A"]    = A;
+  Out["Q"]    = Q;
+  Out["H"]    = H;
+  Out["R"]    = R;
+  Out["Lik"]  = st.lik;
+  Out["X"]    = X;
+  Out["Zz"]   = Zz;
+  Out["Zp"]   = Zp;
+  Out["itc"]  = itc;
+  Out["Ys"]   = Ys;
+  Out["iterations"] = count;
+  Out["em_steps"]   = n_steps;
+  Out["converged"]  = converged;
+
+  return(Out);
+}
+
 
 
 
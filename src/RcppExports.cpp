@@ -1,14 +1,15 @@
 // Generated by using Rcpp::compileAttributes() -> do not edit by hand
 // Generator token: 10BE3573-1514-4C36-9D1C-5A225CD40393
 
+#include "alloc_count.h"
 #include <RcppArmadillo.h>
 #include <Rcpp.h>
 
 using namespace Rcpp;
 
 // EstDFM
-List EstDFM(arma::mat B, arma::mat Bp, arma::sp_mat Jb, double lam_B, arma::mat q, double nu_q, arma::mat H, arma::mat Hp, double lam_H, arma::vec R, arma::vec nu_r, arma::mat Y, arma::uvec freq, arma::uvec LD, bool store_Y, arma::uword store_idx, arma::uword reps, arma::uword burn, bool verbose);
-RcppExport SEXP _bdfm_EstDFM(SEXP BSEXP, SEXP BpSEXP, SEXP JbSEXP, SEXP lam_BSEXP, SEXP qSEXP, SEXP nu_qSEXP, SEXP HSEXP, SEXP HpSEXP, SEXP lam_HSEXP, SEXP RSEXP, SEXP nu_rSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP store_YSEXP, SEXP store_idxSEXP, SEXP repsSEXP, SEXP burnSEXP, SEXP verboseSEXP) {
+List EstDFM(arma::mat B, arma::mat Bp, arma::sp_mat Jb, double lam_B, arma::mat q, double nu_q, arma::mat H, arma::mat Hp, double lam_H, arma::vec R, arma::vec nu_r, arma::mat Y, arma::uvec freq, arma::uvec LD, arma::uword seed, bool store_Y, arma::uword store_idx, arma::uword reps, arma::uword burn, bool verbose, arma::uword chains, arma::uword thin, bool store_draws);
+RcppExport SEXP _bdfm_EstDFM(SEXP BSEXP, SEXP BpSEXP, SEXP JbSEXP, SEXP lam_BSEXP, SEXP qSEXP, SEXP nu_qSEXP, SEXP HSEXP, SEXP HpSEXP, SEXP lam_HSEXP, SEXP RSEXP, SEXP nu_rSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP seedSEXP, SEXP store_YSEXP, SEXP store_idxSEXP, SEXP repsSEXP, SEXP burnSEXP, SEXP verboseSEXP, SEXP chainsSEXP, SEXP thinSEXP, SEXP store_drawsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -26,18 +27,44 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
     Rcpp::traits::input_parameter< arma::uvec >::type freq(freqSEXP);
     Rcpp::traits::input_parameter< arma::uvec >::type LD(LDSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type seed(seedSEXP);
     Rcpp::traits::input_parameter< bool >::type store_Y(store_YSEXP);
     Rcpp::traits::input_parameter< arma::uword >::type store_idx(store_idxSEXP);
     Rcpp::traits::input_parameter< arma::uword >::type reps(repsSEXP);
     Rcpp::traits::input_parameter< arma::uword >::type burn(burnSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
-    rcpp_result_gen = Rcpp::wrap(EstDFM(B, Bp, Jb, lam_B, q, nu_q, H, Hp, lam_H, R, nu_r, Y, freq, LD, store_Y, store_idx, reps, burn, verbose));
+    Rcpp::traits::input_parameter< arma::uword >::type chains(chainsSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type thin(thinSEXP);
+    Rcpp::traits::input_parameter< bool >::type store_draws(store_drawsSEXP);
+    rcpp_result_gen = Rcpp::wrap(EstDFM(B, Bp, Jb, lam_B, q, nu_q, H, Hp, lam_H, R, nu_r, Y, freq, LD, seed, store_Y, store_idx, reps, burn, verbose, chains, thin, store_draws));
+    return rcpp_result_gen;
+END_RCPP
+}
+// PredDFM
+List PredDFM(arma::cube Bstore, arma::sp_mat Jb, arma::cube Qstore, arma::cube Hstore, arma::mat Rstore, arma::mat Y, arma::uvec freq, arma::uvec LD, arma::uvec draws, arma::vec probs, bool simulate, int seed);
+RcppExport SEXP _bdfm_PredDFM(SEXP BstoreSEXP, SEXP JbSEXP, SEXP QstoreSEXP, SEXP HstoreSEXP, SEXP RstoreSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP drawsSEXP, SEXP probsSEXP, SEXP simulateSEXP, SEXP seedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::cube >::type Bstore(BstoreSEXP);
+    Rcpp::traits::input_parameter< arma::sp_mat >::type Jb(JbSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type Qstore(QstoreSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type Hstore(HstoreSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Rstore(RstoreSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type freq(freqSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type LD(LDSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type draws(drawsSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type probs(probsSEXP);
+    Rcpp::traits::input_parameter< bool >::type simulate(simulateSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    rcpp_result_gen = Rcpp::wrap(PredDFM(Bstore, Jb, Qstore, Hstore, Rstore, Y, freq, LD, draws, probs, simulate, seed));
     return rcpp_result_gen;
 END_RCPP
 }
 // Ksmoother
-List Ksmoother(arma::sp_mat A, arma::sp_mat Q, arma::sp_mat HJ, arma::mat R, arma::mat Y);
-RcppExport SEXP _bdfm_Ksmoother(SEXP ASEXP, SEXP QSEXP, SEXP HJSEXP, SEXP RSEXP, SEXP YSEXP) {
+List Ksmoother(arma::sp_mat A, arma::sp_mat Q, arma::sp_mat HJ, arma::mat R, arma::mat Y, bool univariate, bool collapse);
+RcppExport SEXP _bdfm_Ksmoother(SEXP ASEXP, SEXP QSEXP, SEXP HJSEXP, SEXP RSEXP, SEXP YSEXP, SEXP univariateSEXP, SEXP collapseSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -46,7 +73,9 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< arma::sp_mat >::type HJ(HJSEXP);
     Rcpp::traits::input_parameter< arma::mat >::type R(RSEXP);
     Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
-    rcpp_result_gen = Rcpp::wrap(Ksmoother(A, Q, HJ, R, Y));
+    Rcpp::traits::input_parameter< bool >::type univariate(univariateSEXP);
+    Rcpp::traits::input_parameter< bool >::type collapse(collapseSEXP);
+    rcpp_result_gen = Rcpp::wrap(Ksmoother(A, Q, HJ, R, Y, univariate, collapse));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -68,6 +97,28 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// EMdfm
+List EMdfm(arma::sp_mat A, arma::sp_mat Q, arma::mat H, arma::mat R, arma::mat Y, arma::vec itc, arma::uword m, arma::uword p, double tol, arma::uword max_iter, bool accelerate, bool verbose);
+RcppExport SEXP _bdfm_EMdfm(SEXP ASEXP, SEXP QSEXP, SEXP HSEXP, SEXP RSEXP, SEXP YSEXP, SEXP itcSEXP, SEXP mSEXP, SEXP pSEXP, SEXP tolSEXP, SEXP max_iterSEXP, SEXP accelerateSEXP, SEXP verboseSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::sp_mat >::type A(ASEXP);
+    Rcpp::traits::input_parameter< arma::sp_mat >::type Q(QSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type H(HSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type R(RSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type itc(itcSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type m(mSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type p(pSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< bool >::type accelerate(accelerateSEXP);
+    Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
+    rcpp_result_gen = Rcpp::wrap(EMdfm(A, Q, H, R, Y, itc, m, p, tol, max_iter, accelerate, verbose));
+    return rcpp_result_gen;
+END_RCPP
+}
 // J_MF
 arma::sp_mat J_MF(arma::uword days, arma::uword m, arma::uword ld, arma::uword sA);
 RcppExport SEXP _bdfm_J_MF(SEXP daysSEXP, SEXP mSEXP, SEXP ldSEXP, SEXP sASEXP) {
@@ -83,14 +134,15 @@ BEGIN_RCPP
 END_RCPP
 }
 // PrinComp
-List PrinComp(arma::mat Y, arma::uword m);
-RcppExport SEXP _bdfm_PrinComp(SEXP YSEXP, SEXP mSEXP) {
+List PrinComp(arma::mat Y, arma::uword m, bool truncated);
+RcppExport SEXP _bdfm_PrinComp(SEXP YSEXP, SEXP mSEXP, SEXP truncatedSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
     Rcpp::traits::input_parameter< arma::uword >::type m(mSEXP);
-    rcpp_result_gen = Rcpp::wrap(PrinComp(Y, m));
+    Rcpp::traits::input_parameter< bool >::type truncated(truncatedSEXP);
+    rcpp_result_gen = Rcpp::wrap(PrinComp(Y, m, truncated));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -131,8 +183,50 @@ BEGIN_RCPP
 END_RCPP
 }
 // DSmooth
-List DSmooth(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y, arma::uvec freq, arma::uvec LD);
-RcppExport SEXP _bdfm_DSmooth(SEXP BSEXP, SEXP JbSEXP, SEXP qSEXP, SEXP HSEXP, SEXP RSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP) {
+List DSmooth(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y, arma::uvec freq, arma::uvec LD, bool univariate, bool collapse, int keep, bool store_gains);
+RcppExport SEXP _bdfm_DSmooth(SEXP BSEXP, SEXP JbSEXP, SEXP qSEXP, SEXP HSEXP, SEXP RSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP univariateSEXP, SEXP collapseSEXP, SEXP keepSEXP, SEXP store_gainsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::mat >::type B(BSEXP);
+    Rcpp::traits::input_parameter< arma::sp_mat >::type Jb(JbSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type q(qSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type H(HSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type R(RSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type freq(freqSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type LD(LDSEXP);
+    Rcpp::traits::input_parameter< bool >::type univariate(univariateSEXP);
+    Rcpp::traits::input_parameter< bool >::type collapse(collapseSEXP);
+    Rcpp::traits::input_parameter< int >::type keep(keepSEXP);
+    Rcpp::traits::input_parameter< bool >::type store_gains(store_gainsSEXP);
+    rcpp_result_gen = Rcpp::wrap(DSmooth(B, Jb, q, H, R, Y, freq, LD, univariate, collapse, keep, store_gains));
+    return rcpp_result_gen;
+END_RCPP
+}
+// FilterState
+List FilterState(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y, arma::uvec freq, arma::uvec LD, arma::vec Zi, arma::mat Pi);
+RcppExport SEXP _bdfm_FilterState(SEXP BSEXP, SEXP JbSEXP, SEXP qSEXP, SEXP HSEXP, SEXP RSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP ZiSEXP, SEXP PiSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::mat >::type B(BSEXP);
+    Rcpp::traits::input_parameter< arma::sp_mat >::type Jb(JbSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type q(qSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type H(HSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type R(RSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type freq(freqSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type LD(LDSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type Zi(ZiSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Pi(PiSEXP);
+    rcpp_result_gen = Rcpp::wrap(FilterState(B, Jb, q, H, R, Y, freq, LD, Zi, Pi));
+    return rcpp_result_gen;
+END_RCPP
+}
+// DSupdate
+List DSupdate(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y, arma::uvec freq, arma::uvec LD, arma::vec Zi, arma::mat Pi, arma::uword n_safe, bool univariate, bool collapse);
+RcppExport SEXP _bdfm_DSupdate(SEXP BSEXP, SEXP JbSEXP, SEXP qSEXP, SEXP HSEXP, SEXP RSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP ZiSEXP, SEXP PiSEXP, SEXP n_safeSEXP, SEXP univariateSEXP, SEXP collapseSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -144,13 +238,62 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
     Rcpp::traits::input_parameter< arma::uvec >::type freq(freqSEXP);
     Rcpp::traits::input_parameter< arma::uvec >::type LD(LDSEXP);
-    rcpp_result_gen = Rcpp::wrap(DSmooth(B, Jb, q, H, R, Y, freq, LD));
+    Rcpp::traits::input_parameter< arma::vec >::type Zi(ZiSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Pi(PiSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type n_safe(n_safeSEXP);
+    Rcpp::traits::input_parameter< bool >::type univariate(univariateSEXP);
+    Rcpp::traits::input_parameter< bool >::type collapse(collapseSEXP);
+    rcpp_result_gen = Rcpp::wrap(DSupdate(B, Jb, q, H, R, Y, freq, LD, Zi, Pi, n_safe, univariate, collapse));
+    return rcpp_result_gen;
+END_RCPP
+}
+// DSnews
+List DSnews(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y_old, arma::mat Y_new, arma::uvec freq, arma::uvec LD, arma::uword target, arma::uword n_back, bool univariate, bool collapse, Rcpp::Nullable<Rcpp::List> state);
+RcppExport SEXP _bdfm_DSnews(SEXP BSEXP, SEXP JbSEXP, SEXP qSEXP, SEXP HSEXP, SEXP RSEXP, SEXP Y_oldSEXP, SEXP Y_newSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP targetSEXP, SEXP n_backSEXP, SEXP univariateSEXP, SEXP collapseSEXP, SEXP stateSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::mat >::type B(BSEXP);
+    Rcpp::traits::input_parameter< arma::sp_mat >::type Jb(JbSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type q(qSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type H(HSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type R(RSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Y_old(Y_oldSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Y_new(Y_newSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type freq(freqSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type LD(LDSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type target(targetSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type n_back(n_backSEXP);
+    Rcpp::traits::input_parameter< bool >::type univariate(univariateSEXP);
+    Rcpp::traits::input_parameter< bool >::type collapse(collapseSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::List> >::type state(stateSEXP);
+    rcpp_result_gen = Rcpp::wrap(DSnews(B, Jb, q, H, R, Y_old, Y_new, freq, LD, target, n_back, univariate, collapse, state));
     return rcpp_result_gen;
 END_RCPP
 }
 // DSMF
-arma::mat DSMF(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y, arma::uvec freq, arma::uvec LD);
-RcppExport SEXP _bdfm_DSMF(SEXP BSEXP, SEXP JbSEXP, SEXP qSEXP, SEXP HSEXP, SEXP RSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP) {
+arma::mat DSMF(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y, arma::uvec freq, arma::uvec LD, bool univariate, bool collapse);
+RcppExport SEXP _bdfm_DSMF(SEXP BSEXP, SEXP JbSEXP, SEXP qSEXP, SEXP HSEXP, SEXP RSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP univariateSEXP, SEXP collapseSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::mat >::type B(BSEXP);
+    Rcpp::traits::input_parameter< arma::sp_mat >::type Jb(JbSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type q(qSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type H(HSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type R(RSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type freq(freqSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type LD(LDSEXP);
+    Rcpp::traits::input_parameter< bool >::type univariate(univariateSEXP);
+    Rcpp::traits::input_parameter< bool >::type collapse(collapseSEXP);
+    rcpp_result_gen = Rcpp::wrap(DSMF(B, Jb, q, H, R, Y, freq, LD, univariate, collapse));
+    return rcpp_result_gen;
+END_RCPP
+}
+// SimSmooth
+arma::mat SimSmooth(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y, arma::uvec freq, arma::uvec LD, bool univariate, bool collapse);
+RcppExport SEXP _bdfm_SimSmooth(SEXP BSEXP, SEXP JbSEXP, SEXP qSEXP, SEXP HSEXP, SEXP RSEXP, SEXP YSEXP, SEXP freqSEXP, SEXP LDSEXP, SEXP univariateSEXP, SEXP collapseSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -162,7 +305,9 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< arma::mat >::type Y(YSEXP);
     Rcpp::traits::input_parameter< arma::uvec >::type freq(freqSEXP);
     Rcpp::traits::input_parameter< arma::uvec >::type LD(LDSEXP);
-    rcpp_result_gen = Rcpp::wrap(DSMF(B, Jb, q, H, R, Y, freq, LD));
+    Rcpp::traits::input_parameter< bool >::type univariate(univariateSEXP);
+    Rcpp::traits::input_parameter< bool >::type collapse(collapseSEXP);
+    rcpp_result_gen = Rcpp::wrap(SimSmooth(B, Jb, q, H, R, Y, freq, LD, univariate, collapse));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -232,6 +377,29 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// is_stationary
+bool is_stationary(arma::mat B);
+RcppExport SEXP _bdfm_is_stationary(SEXP BSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::mat >::type B(BSEXP);
+    rcpp_result_gen = Rcpp::wrap(is_stationary(B));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Lyapunov
+arma::mat Lyapunov(const arma::mat& A, const arma::mat& Q);
+RcppExport SEXP _bdfm_Lyapunov(SEXP ASEXP, SEXP QSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type A(ASEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type Q(QSEXP);
+    rcpp_result_gen = Rcpp::wrap(Lyapunov(A, Q));
+    return rcpp_result_gen;
+END_RCPP
+}
 // mvrnrm
 arma::mat mvrnrm(int n, arma::vec mu, arma::mat Sigma);
 RcppExport SEXP _bdfm_mvrnrm(SEXP nSEXP, SEXP muSEXP, SEXP SigmaSEXP) {
@@ -245,6 +413,33 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// mvrnrm_chol
+arma::mat mvrnrm_chol(int n, const arma::vec& mu, const arma::mat& U, double s);
+RcppExport SEXP _bdfm_mvrnrm_chol(SEXP nSEXP, SEXP muSEXP, SEXP USEXP, SEXP sSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type n(nSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type mu(muSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type U(USEXP);
+    Rcpp::traits::input_parameter< double >::type s(sSEXP);
+    rcpp_result_gen = Rcpp::wrap(mvrnrm_chol(n, mu, U, s));
+    return rcpp_result_gen;
+END_RCPP
+}
+// mnrnrm_chol
+arma::mat mnrnrm_chol(const arma::mat& M, const arma::mat& U, const arma::mat& L);
+RcppExport SEXP _bdfm_mnrnrm_chol(SEXP MSEXP, SEXP USEXP, SEXP LSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type M(MSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type U(USEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type L(LSEXP);
+    rcpp_result_gen = Rcpp::wrap(mnrnrm_chol(M, U, L));
+    return rcpp_result_gen;
+END_RCPP
+}
 // rinvwish
 arma::cube rinvwish(int n, int v, arma::mat S);
 RcppExport SEXP _bdfm_rinvwish(SEXP nSEXP, SEXP vSEXP, SEXP SSEXP) {
@@ -270,6 +465,17 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// omp_threads
+int omp_threads(int n);
+RcppExport SEXP _bdfm_omp_threads(SEXP nSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type n(nSEXP);
+    rcpp_result_gen = Rcpp::wrap(omp_threads(n));
+    return rcpp_result_gen;
+END_RCPP
+}
 // stack_obs
 arma:: mat stack_obs(arma::mat nn, arma::uword p, arma::uword r);
 RcppExport SEXP _bdfm_stack_obs(SEXP nnSEXP, SEXP pSEXP, SEXP rSEXP) {
@@ -283,26 +489,72 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// p2_quantile
+arma::vec p2_quantile(arma::mat X, double p, arma::uword sketches);
+RcppExport SEXP _bdfm_p2_quantile(SEXP XSEXP, SEXP pSEXP, SEXP sketchesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::mat >::type X(XSEXP);
+    Rcpp::traits::input_parameter< double >::type p(pSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type sketches(sketchesSEXP);
+    rcpp_result_gen = Rcpp::wrap(p2_quantile(X, p, sketches));
+    return rcpp_result_gen;
+END_RCPP
+}
+#ifdef BDFM_ALLOC_COUNT
+// alloc_count_start (test builds only, see alloc_count.h)
+RcppExport SEXP _bdfm_alloc_count_start() {
+BEGIN_RCPP
+    alloc_count_start();
+    return R_NilValue;
+END_RCPP
+}
+// alloc_count_stop
+RcppExport SEXP _bdfm_alloc_count_stop() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    rcpp_result_gen = Rcpp::wrap((double) alloc_count_stop());
+    return rcpp_result_gen;
+END_RCPP
+}
+#endif
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_bdfm_EstDFM", (DL_FUNC) &_bdfm_EstDFM, 19},
-    {"_bdfm_Ksmoother", (DL_FUNC) &_bdfm_Ksmoother, 5},
+    {"_bdfm_EstDFM", (DL_FUNC) &_bdfm_EstDFM, 23},
+    {"_bdfm_PredDFM", (DL_FUNC) &_bdfm_PredDFM, 12},
+    {"_bdfm_Ksmoother", (DL_FUNC) &_bdfm_Ksmoother, 7},
     {"_bdfm_KestExact", (DL_FUNC) &_bdfm_KestExact, 8},
+    {"_bdfm_EMdfm", (DL_FUNC) &_bdfm_EMdfm, 12},
     {"_bdfm_J_MF", (DL_FUNC) &_bdfm_J_MF, 4},
-    {"_bdfm_PrinComp", (DL_FUNC) &_bdfm_PrinComp, 2},
+    {"_bdfm_PrinComp", (DL_FUNC) &_bdfm_PrinComp, 3},
     {"_bdfm_BReg", (DL_FUNC) &_bdfm_BReg, 8},
     {"_bdfm_BReg_diag", (DL_FUNC) &_bdfm_BReg_diag, 8},
-    {"_bdfm_DSmooth", (DL_FUNC) &_bdfm_DSmooth, 8},
-    {"_bdfm_DSMF", (DL_FUNC) &_bdfm_DSMF, 8},
+    {"_bdfm_DSmooth", (DL_FUNC) &_bdfm_DSmooth, 12},
+    {"_bdfm_FilterState", (DL_FUNC) &_bdfm_FilterState, 10},
+    {"_bdfm_DSupdate", (DL_FUNC) &_bdfm_DSupdate, 13},
+    {"_bdfm_DSnews", (DL_FUNC) &_bdfm_DSnews, 14},
+    {"_bdfm_DSMF", (DL_FUNC) &_bdfm_DSMF, 10},
+    {"_bdfm_SimSmooth", (DL_FUNC) &_bdfm_SimSmooth, 10},
     {"_bdfm_FSimMF", (DL_FUNC) &_bdfm_FSimMF, 8},
     {"_bdfm_Identify", (DL_FUNC) &_bdfm_Identify, 2},
     {"_bdfm_QuickReg", (DL_FUNC) &_bdfm_QuickReg, 2},
     {"_bdfm_UVreg", (DL_FUNC) &_bdfm_UVreg, 3},
     {"_bdfm_comp_form", (DL_FUNC) &_bdfm_comp_form, 1},
+    {"_bdfm_is_stationary", (DL_FUNC) &_bdfm_is_stationary, 1},
+    {"_bdfm_Lyapunov", (DL_FUNC) &_bdfm_Lyapunov, 2},
     {"_bdfm_mvrnrm", (DL_FUNC) &_bdfm_mvrnrm, 3},
+    {"_bdfm_mvrnrm_chol", (DL_FUNC) &_bdfm_mvrnrm_chol, 4},
+    {"_bdfm_mnrnrm_chol", (DL_FUNC) &_bdfm_mnrnrm_chol, 3},
     {"_bdfm_rinvwish", (DL_FUNC) &_bdfm_rinvwish, 3},
     {"_bdfm_invchisq", (DL_FUNC) &_bdfm_invchisq, 2},
+    {"_bdfm_omp_threads", (DL_FUNC) &_bdfm_omp_threads, 1},
     {"_bdfm_stack_obs", (DL_FUNC) &_bdfm_stack_obs, 3},
+    {"_bdfm_p2_quantile", (DL_FUNC) &_bdfm_p2_quantile, 3},
+#ifdef BDFM_ALLOC_COUNT
+    {"_bdfm_alloc_count_start", (DL_FUNC) &_bdfm_alloc_count_start, 0},
+    {"_bdfm_alloc_count_stop", (DL_FUNC) &_bdfm_alloc_count_stop, 0},
+#endif
     {NULL, NULL, 0}
 };
 
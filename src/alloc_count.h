@@ -0,0 +1,31 @@
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+// Counting of heap allocations, for tests only. In a build with BDFM_ALLOC_COUNT defined, e.g.
+//
+//   PKG_CPPFLAGS=-DBDFM_ALLOC_COUNT R CMD INSTALL .
+//
+// Armadillo's memory is taken through alloc_count_acquire and alloc_count_release, the global
+// operator new is replaced (utils.cpp), and the routines _bdfm_alloc_count_start and
+// _bdfm_alloc_count_stop are registered (RcppExports.cpp, by hand, as they have no R wrapper).
+// Allocations made between the two calls are counted. Other builds are unchanged and have none of
+// these routines.
+//
+// All translation units must use the same Armadillo allocator, so this header is included before
+// RcppArmadillo.h in every source file.
+
+#ifdef BDFM_ALLOC_COUNT
+
+#include <cstddef>
+
+void* alloc_count_acquire(std::size_t n);
+void alloc_count_release(void* p);
+void alloc_count_start();
+std::size_t alloc_count_stop();
+
+#define ARMA_ALIEN_MEM_ALLOC_FUNCTION alloc_count_acquire
+#define ARMA_ALIEN_MEM_FREE_FUNCTION  alloc_count_release
+
+#endif
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <RcppArmadillo.h>
+#include <vector>
+
+// Types shared by the Kalman filters and the simulation smoother. These are kept out of toolbox.h
+// so that toolbox.cpp, which defines exported functions with default arguments, can include them.
+
+// Unique patterns of missing values in the data. These depend only on which observations are
+// missing, so they are found once per data set and reused across periods and across draws.
+struct ObsPatterns{
+  arma::field<arma::uvec> ind;     // observed series for each pattern
+  arma::field<arma::uvec> periods; // periods with each pattern
+  arma::uvec id;                   // pattern of each period
+  arma::uvec miss;                 // linear index of missing elements of the data
+};
+
+// Observation matrices for each pattern of missing values. These depend on parameters, so they
+// are built once per call to a filter and shared by all periods with the same pattern.
+struct ObsMats{
+  arma::field<arma::mat> H;   // observed rows of HJ
+  arma::field<arma::mat> R;   // observed rows and columns of R (multivariate filtering)
+  arma::field<arma::vec> Rd;  // observed elements of diag(R) (univariate filtering)
+  arma::field<arma::vec> Ri;  // 1/diag(R) (collapsed filtering)
+  arma::field<arma::mat> W;   // H'R^-1*H (collapsed filtering)
+  arma::vec ldR;              // log|R| (collapsed filtering)
+  arma::mat HJd;              // HJ in full, from which the rows are taken
+};
+
+// Companion form transition matrix A = [Bc; I 0]. In products with A only the top m rows need
+// arithmetic; the remaining rows are the state shifted down by m.
+struct Companion{
+  arma::mat Bc;     // top m rows of A (all of A if it has no companion structure)
+  arma::uword m;    // rows of Bc
+  arma::uword sA;   // size of the state
+};
+
+// Aggregation of high frequency factors into a low frequency observation. J_MF(days, m, ld, sA)
+// is [w(0)*I w(1)*I ... 0] with m x m identity blocks, so it is applied using the weights alone.
+struct MFAgg{
+  arma::vec w;      // weight on each lag of the factors
+  arma::uword m;    // number of factors (the stride between lags in the state)
+  arma::uword sA;   // size of the state
+  arma::sp_mat J;   // J_MF(days, m, ld, sA), for callers that need the matrix
+};
+
+// Aggregations for each series of a model, built once for each distinct (frequency, differencing)
+struct MFCache{
+  std::vector<MFAgg> agg;  // distinct aggregations
+  arma::uvec id;           // aggregation used by each series
+};
+
+// Relative tolerance for convergence of the predicted state variance to its steady state
+const double ss_tol = 1e-10;
+
+// Longest cycle of patterns of missing values for which the filter looks for a steady state, e.g.
+// the twelve months of a year in a monthly panel with annual series
+const arma::uword max_cycle = 12;
+
+// Output of the forward pass of the disturbance smoother. Gains depend only on the predicted
+// variance and the pattern of missing values, so they are stored by slot rather than by period.
+// Periods in a run with the same pattern share a slot once the predicted variance has converged.
+struct FilterOut{
+  arma::mat Z;                // filtered states
+  arma::mat Zp;               // predicted states
+  arma::field<arma::vec> PE;  // prediction errors (Hn'S^-1*PE for collapsed filtering)
+  arma::field<arma::mat> K;   // gain for each slot (P0 for collapsed filtering)
+  arma::field<arma::mat> Si;  // S^-1, 1/F (univariate) or (I + W*P1)^-1 (collapsed) for each slot
+  arma::vec ld;               // log|S| (less log|R| for collapsed filtering) for each slot
+  arma::uvec slot;            // slot used in each period
+  arma::uword n_steady;       // number of periods using a steady state slot
+  double lik;                 // log likelihood
+  arma::uword snap = 0;       // if not 0, KFilter saves the predicted state and variance for row
+  arma::vec Zsnap;            // snap (from 0) of the data in Zsnap and Psnap, e.g. the state to
+  arma::mat Psnap;            // save for an update (DSupdate)
+};
+
+// Output of the smoother for EM estimation. Smoothed state variances enter EM only through sums, so
+// only the sums are kept.
+struct EMStats{
+  arma::mat Z;                // smoothed states
+  arma::mat Zf;               // filtered states
+  arma::mat Zp;               // predicted states
+  arma::mat V;                // sum of smoothed state variances over all periods
+  arma::field<arma::mat> Vm;  // sum of their top m x m blocks over periods with each pattern
+  double lik;                 // log likelihood
+};
+
+// Work memory for the recursions of KFilter, kf_step and DSback, so that repeated filtering of a model
+// of the same size writes into the same buffers. Quantities whose length is the number of
+// observations in a period, which changes with the pattern of missing values, are views of the
+// first n elements of buffers sized once for all k series.
+struct KFWork{
+  arma::mat P0, P1;          // filtered and predicted variance of the state
+  arma::mat K, Si;           // gain of the last period, for filtering without slots (kf_step)
+  arma::field<arma::mat> P1c; // predicted variances of the last max_cycle periods
+  arma::mat BP;              // Bc*P, for A*P*A'
+  arma::mat C, M, PW;        // Cholesky factor of P1, I + C*W*C' and P0*W (collapsed filtering)
+  arma::mat PHk, Sk, Ck;     // P1*Hn', S and its Cholesky factor for up to k observations
+  arma::vec Zp, Zu;          // predicted and filtered state
+  arma::vec yk, pk, ek, rk;  // max(k, sA) elements each, viewed at the length of a period
+  arma::vec b, e, Pe, ph;    // Hn'R^-1*Yn and work for collapsed and univariate updates
+  arma::rowvec rA, rB;       // r*A and work for the backward pass
+};
+
+// Memory for repeated draws of the factors, e.g. one per chain in EstDFM. SimSmooth sizes these on
+// first use and writes into them in place, so that later draws of a model of the same size do not
+// reallocate them: the T sized buffers, the model matrices and the work of the filter and smoother
+// are all reused. A draw still allocates for the work of eigen decompositions (the square roots of
+// q, Pi and a non diagonal R), Cholesky factors and inverses (the gains of the filter), the sparse
+// HJ and Q, and a few expression temporaries. A build with BDFM_ALLOC_COUNT (alloc_count.h) counts
+// them.
+struct DrawWork{
+  arma::mat U;       // standard normal draws for shocks to observables (k x T)
+  arma::mat Ue;      // standard normal draws for shocks to factors (m x T)
+  arma::mat Eps;     // simulated shocks to observables
+  arma::mat E;       // simulated shocks to factors
+  arma::mat Zd;      // simulated factors, then the draw of the factors
+  arma::mat Ys;      // data less simulated data
+  arma::mat Zs;      // smoothed mean of the factors given Ys
+  arma::mat r;       // backward recursion of the disturbance smoother
+  arma::mat Zr;      // rotated factors (DrawParms)
+  FilterOut kf;      // forward pass of the filter
+  MFCache mf;        // aggregation of the factors for each series
+  arma::sp_mat HJ;   // loadings of each series on the state
+  Companion A;       // transition matrix
+  arma::sp_mat Q;    // covariance of shocks to the state
+  arma::mat Af;      // transition matrix in full, for Pi
+  arma::mat Qd;      // Q in full, for Pi
+  arma::mat Pi;      // initial variance of the state
+  arma::mat Ak;      // work for Lyapunov
+  arma::mat AP;      // work for Lyapunov
+  arma::mat C;       // square root of Pi
+  arma::mat Cq;      // square root of q
+  arma::mat Cr;      // square root of R, if it is not diagonal
+  arma::vec ev, evq, evr; // work for sqrt_psd, one for each square root so that none is resized
+  arma::vec z;       // simulated state
+  arma::vec Az;      // A*z
+  ObsMats om;        // observation matrices for each pattern of missing values
+  arma::mat Rd;      // R in full when it is passed as its diagonal (DrawFactors)
+  KFWork w;          // work for the filter and smoother
+};
+
+#endif
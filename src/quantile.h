@@ -0,0 +1,17 @@
+#ifndef QUANTILE_H
+#define QUANTILE_H
+
+#include <RcppArmadillo.h>
+
+// Streaming estimate of the p quantile of each element of a vector of draws, by the P^2 algorithm
+// of Jain and Chlamtac (1985). Memory is five markers per element whatever the number of draws.
+struct P2Quantile{
+  double p;           // quantile
+  arma::uword count;  // number of draws added
+  arma::mat q;        // marker heights (5 x n)
+  arma::mat pos;      // marker positions (5 x n), 1 indexed
+  arma::vec des;      // desired marker positions, the same for every element
+  arma::vec inc;      // increments to the desired positions for each draw
+};
+
+#endif
@@ -1,10 +1,52 @@
 // [[Rcpp::depends(RcppArmadillo)]]
 
+#include "alloc_count.h"
 #include <RcppArmadillo.h>
+#include <map>
+#include <vector>
 #include "utils.h"
+#include "filter.h"
 using namespace arma;
 using namespace Rcpp;
 
+// Internal overloads, defined after the exported functions that call them
+List DSmooth(const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q, const arma::mat& H,
+             const arma::mat& R, const arma::mat& Y, const arma::uvec& freq, const arma::uvec& LD,
+             bool univariate, bool collapse, int keep, bool store_gains, const ObsPatterns& pat);
+arma::mat DSMF(const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q, const arma::mat& H,
+               const arma::mat& R, const arma::mat& Y, const arma::uvec& freq, const arma::uvec& LD,
+               bool univariate, bool collapse, const ObsPatterns& pat);
+arma::mat SimSmooth(const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q, const arma::mat& H,
+                    const arma::mat& R, const arma::mat& Y, const arma::uvec& freq, const arma::uvec& LD,
+                    bool univariate, bool collapse, const ObsPatterns& pat, rng_stream& rng);
+void SimSmooth(DrawWork& ws, const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q,
+               const arma::mat& H, const arma::mat& R, const arma::mat& Y, const arma::uvec& freq,
+               const arma::uvec& LD, bool univariate, bool collapse, const ObsPatterns& pat,
+               rng_stream& rng);
+arma::field<arma::mat> FSimMF(const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q,
+                              const arma::mat& H, const arma::mat& R, const arma::mat& Y,
+                              const arma::uvec& freq, const arma::uvec& LD, const ObsPatterns& pat,
+                              rng_stream& rng);
+
+
+// Weights on each lag of the factors for a series observed as an aggregate over days high
+// frequency periods, either in levels (ld = 0) or in differences (ld = 1)
+arma::vec mf_weights(arma::uword days,
+                     arma::uword ld){
+  vec w;
+  if(days == 1){
+    w = ones<vec>(1);
+  }else if(ld == 0){
+    w = ones<vec>(days)/days;
+  }else if(ld == 1){
+    w.set_size(2*days-1);
+    w.head(days)   = regspace(1,days)/days;
+    w.tail(days-1) = regspace(days-1,1)/days;
+  }else{
+    throw std::runtime_error("LD must be 0 (levels) or 1 (differences)");
+  }
+  return(w);
+}
 
 //Return the appropriate mixed frequency helper matrix
 // [[Rcpp::export]]
@@ -12,55 +54,240 @@ arma::sp_mat J_MF(arma::uword days, //number of high frequency periods in the lo
                   arma::uword m,    //number of factors
                   arma::uword ld,   //type --- either level or difference
                   arma::uword sA){  //total number of columns (i.e. number of factors or size of A matrix)
-  mat jm;
-  if(days == 1){
-    jm = eye<mat>(m,m);
-  }else{
-    if(ld == 0){
-      mat weight = ones(1,days)/days;
-      jm     = kron(weight,eye<mat>(m,m));
-    }
-    else if(ld == 1){
-      mat weight(1,2*days-1);
-      weight.cols(0,days-1) = trans(regspace(1,days))/days;
-      weight.cols(days,2*days-2) = trans(regspace(days-1,1))/days;
-      jm   = kron(weight,eye<mat>(m,m));
+  vec w = mf_weights(days, ld);
+  if(m*w.n_elem > sA){
+    throw std::runtime_error("Too few lags in the state for the mixed frequency aggregation");
+  }
+  // w(l) on the diagonal of the l'th m x m block
+  umat loc(2, m*w.n_elem);
+  vec  val(m*w.n_elem);
+  for(uword l = 0; l < w.n_elem; l++){
+    for(uword i = 0; i < m; i++){
+      loc(0,l*m+i) = i;
+      loc(1,l*m+i) = l*m+i;
+      val(l*m+i)   = w(l);
     }
   }
-  sp_mat Jm(m,sA);
-  Jm(span(0,m-1),span(0,jm.n_cols-1)) =  MakeSparse(jm);
+  sp_mat Jm(loc, val, m, sA);
   return(Jm);
 }
 
+// Aggregations of the factors for each series, built once per model
+MFCache mf_cache(const arma::uvec& freq,
+                 const arma::uvec& LD,
+                 arma::uword m,
+                 arma::uword sA){
+  MFCache mf;
+  std::map<std::pair<uword,uword>,uword> keys;
+  mf.id.set_size(freq.n_elem);
+  for(uword j = 0; j < freq.n_elem; j++){
+    std::pair<uword,uword> key(freq(j), freq(j) == 1 ? 0 : LD(j)); //LD has no effect at frequency 1
+    auto it = keys.find(key);
+    if(it == keys.end()){
+      MFAgg a;
+      a.J  = J_MF(freq(j), m, LD(j), sA);
+      a.w  = mf_weights(freq(j), LD(j));
+      a.m  = m;
+      a.sA = sA;
+      it   = keys.insert(std::make_pair(key, mf.agg.size())).first;
+      mf.agg.push_back(a);
+    }
+    mf.id(j) = it->second;
+  }
+  return(mf);
+}
+
+// Z.rows(t0, t0+T-1)*trans(J), summing weighted blocks of columns of Z
+arma::mat mf_ZJt(const arma::mat& Z,
+                 arma::uword t0,
+                 arma::uword T,
+                 const MFAgg& a){
+  mat X = a.w(0)*Z.submat(t0, 0, t0+T-1, a.m-1);
+  for(uword l = 1; l < a.w.n_elem; l++){
+    X += a.w(l)*Z.submat(t0, l*a.m, t0+T-1, (l+1)*a.m-1);
+  }
+  return(X);
+}
+
+// h*J, placing weighted copies of h in blocks of the state
+arma::rowvec mf_hJ(const arma::rowvec& h,
+                   const MFAgg& a){
+  rowvec hj(a.sA, fill::zeros);
+  for(uword l = 0; l < a.w.n_elem; l++){
+    hj.cols(l*a.m, (l+1)*a.m-1) = a.w(l)*h;
+  }
+  return(hj);
+}
+
+// HJ for loadings H. For frequencies that do not change rows of HJ will be fixed. Row j of HJ is
+// w(l)*H.row(j) in block l of the state, so the non-zero elements are listed in column major order
+// and HJ is assembled in a single pass.
+arma::sp_mat mf_HJ(const arma::mat& H,
+                   const MFCache& mf){
+  uword k  = H.n_rows;
+  uword m  = H.n_cols;
+  uword sA = mf.agg[0].sA;
+  uvec  L(k);  //lags used by each series
+  for(uword j = 0; j < k; j++){
+    L(j) = mf.agg[mf.id(j)].w.n_elem;
+  }
+  umat loc(2, m*accu(L));
+  vec  val(loc.n_cols);
+  uword n = 0;
+  for(uword l = 0; l < L.max(); l++){
+    for(uword i = 0; i < m; i++){
+      for(uword j = 0; j < k; j++){
+        if(l < L(j)){
+          loc(0,n) = j;
+          loc(1,n) = l*m+i;
+          val(n)   = mf.agg[mf.id(j)].w(l)*H(j,i);
+          n++;
+        }
+      }
+    }
+  }
+  sp_mat HJ(loc, val, k, sA, false, true); //already sorted; drop zero loadings
+  return(HJ);
+}
+
+// In place version for repeated draws of H. The values of HJ are overwritten when the non-zero
+// loadings are in the same positions as before (the usual case), otherwise HJ is rebuilt.
+void mf_HJ(arma::sp_mat& HJ,
+           const arma::mat& H,
+           const MFCache& mf){
+  uword k  = H.n_rows;
+  uword m  = H.n_cols;
+  uword sA = mf.agg[0].sA;
+  bool same = HJ.n_rows == k && HJ.n_cols == sA && sA%m == 0;
+  if(same){
+    double* val = access::rwp(HJ.values);
+    uword n = 0;
+    for(uword c = 0; c < sA && same; c++){ //column c is lag c/m of factor c%m
+      for(uword j = 0; j < k && same; j++){
+        const vec& w = mf.agg[mf.id(j)].w;
+        double v = c/m < w.n_elem ? w(c/m)*H(j,c%m) : 0;
+        if(v != 0){
+          same = n < HJ.n_nonzero && HJ.row_indices[n] == j;
+          if(same){
+            val[n++] = v;
+          }
+        }
+      }
+      same = same && HJ.col_ptrs[c+1] == n;
+    }
+  }
+  if(!same){
+    HJ = mf_HJ(H, mf);
+  }
+}
+
+// Covariance of shocks to the state, [q 0; 0 0], written into Q in place when its non-zero elements
+// are in the same positions as before
+void state_cov(arma::sp_mat& Q,
+               const arma::mat& q,
+               arma::uword sA){
+  uword m = q.n_rows;
+  bool same = Q.n_rows == sA && Q.n_cols == sA;
+  if(same){
+    double* val = access::rwp(Q.values);
+    uword n = 0;
+    for(uword c = 0; c < sA && same; c++){
+      for(uword j = 0; j < m && c < m && same; j++){
+        if(q(j,c) != 0){
+          same = n < Q.n_nonzero && Q.row_indices[n] == j;
+          if(same){
+            val[n++] = q(j,c);
+          }
+        }
+      }
+      same = same && Q.col_ptrs[c+1] == n;
+    }
+  }
+  if(!same){
+    mat qq(sA,sA,fill::zeros);
+    qq(span(0,m-1),span(0,m-1)) = q;
+    Q = sp_mat(qq);
+  }
+}
+
+// Largest m eigenvalues (in descending order) and their eigenvectors of a symmetric matrix S, by
+// randomized subspace iteration with Rayleigh-Ritz extraction (Halko, Martinsson and Tropp 2011).
+// Only products of S with k x b blocks are needed, b = m plus a few extra vectors, rather than the
+// full spectrum. Iterates until the residuals |S*v - d*v| of the m leading pairs are below tol times
+// the largest eigenvalue, falling back to the full eigendecomposition if that takes more than
+// max_iter iterations. The iteration finds the eigenvalues largest in magnitude, which are the
+// largest ones only while they are positive. S may be indefinite (PrinComp's covariance with
+// missing data), so the Ritz values are ranked by signed value and the full eigendecomposition is
+// also used when any of the m retained is not positive. The starting block is drawn from a fixed
+// stream, so results are reproducible and do not touch R's random number generator.
+void eig_top(arma::vec& eigval,
+             arma::mat& eigvec,
+             const arma::mat& S,
+             arma::uword m,
+             double tol = 1e-10,
+             arma::uword max_iter = 300){
+  uword k = S.n_rows;
+  uword b = std::min<uword>(k, m + 10);
+  vec d;
+  mat Q, Rq, V, X, SQ;
+  if(b < k){
+    rng_stream rng(1);
+    mat Omega(k, b);
+    randn_stream(Omega, rng);
+    qr_econ(Q, Rq, S*Omega);
+    for(uword it = 0; it < max_iter; it++){
+      SQ = S*Q;
+      mat Tq = trans(Q)*SQ;
+      eig_sym(d, V, (Tq+trans(Tq))/2); //ascending order
+      eigval = flipud(d.tail(m));
+      V      = fliplr(V.tail_cols(m));
+      eigvec = Q*V;
+      X      = SQ*V - eigvec*diagmat(eigval);
+      if(max(sqrt(sum(square(X),0))) <= tol*max(abs(d))){
+        if(eigval(m-1) > 0){
+          return;
+        }
+        break;
+      }
+      qr_econ(Q, Rq, SQ);
+    }
+  }
+  //nothing to gain from iterating, no convergence (e.g. eigenvalues m and m+1 nearly equal), or S
+  //is indefinite and a negative eigenvalue could hide a larger positive one
+  eig_sym(d, V, S);
+  eigval = flipud(d.tail(m));
+  eigvec = fliplr(V.tail_cols(m));
+}
+
 //Principal Components
 // [[Rcpp::export]]
 List PrinComp(arma::mat Y,     // Observations Y
-              arma::uword m){   // number of components
-  
-  //Preliminaries
-  uword k = Y.n_cols;
-  
-  //Covariance matrix (may not be PSD due to missing data)
-  vec Yj, Yi, Yt;
-  mat Sig(k,k,fill::zeros);
-  uvec ind;
-  double tmp;
-  for(uword j=0; j<k; j++){ //loop over variables
-    Yj   = Y.col(j);
-    for(uword i = 0; i<=j; i++){
-      Yi  = Y.col(i);
-      Yt  = Yj%Yi; //element wise multiplication
-      ind = find_finite(Yt);
-      tmp = sum(Yt(ind))/ind.n_elem;
-      Sig(j,i) = tmp;
-      Sig(i,j) = tmp;
-    }
+              arma::uword m,   // number of components
+              bool truncated = false){ // find only the top m eigenvectors of the covariance
+  
+  //Covariance matrix (may not be PSD due to missing data). Each element averages over periods in
+  //which both series are observed. With missing values set to zero and M = 1 where Y is observed,
+  //that is (Y'Y)/(M'M), which is two symmetric matrix products rather than a loop over pairs.
+  uvec miss = find_nonfinite(Y);
+  mat  Y0   = Y;
+  Y0.elem(miss).zeros();
+  mat  Sig  = trans(Y0)*Y0;
+  if(miss.n_elem > 0){
+    mat M(size(Y), fill::ones);
+    M.elem(miss).zeros();
+    Sig /= trans(M)*M;
+  }else{
+    Sig /= Y.n_rows;
   }
   vec eigval;
-  mat eigvec;
-  eig_sym(eigval, eigvec, Sig);
-  eigvec = fliplr(eigvec); //put in decending order
-  mat loadings   = eigvec.cols(0,m-1);
+  mat eigvec, loadings;
+  if(truncated){
+    eig_top(eigval, loadings, Sig, m);
+  }else{
+    eig_sym(eigval, eigvec, Sig);
+    eigvec   = fliplr(eigvec); //put in decending order
+    loadings = eigvec.cols(0,m-1);
+  }
   mat components = Y*loadings;
   
   List Out;
@@ -101,8 +328,14 @@ List BReg(arma::mat X,   // RHS variables
   
   //declairing variables
   cube Bstore(k,m,reps), Qstore(k,k,reps);
-  mat v_1, V_1, Mu, B, Beta, scale, q;
-  vec mu;
+  mat U, Mu, B, scale, q;
+  
+  //The posterior precision of B, its mean and the scale for q do not depend on the draws
+  U     = trans(X)*X+Lam;
+  U     = chol((trans(U)+U)/2);     // Cholesky factor of the posterior precision
+  Mu    = chol_solve(U, trans(X)*Y+Lam*trans(Bp));
+  scale = eye(k,k)+trans(Y-X*Mu)*(Y-X*Mu)+trans(Mu-trans(Bp))*Lam*(Mu-trans(Bp)); // eye(k) is the prior scale parameter for the IW distribution and eye(k)+junk the posterior.
+  scale = (scale+trans(scale))/2;
   
   //Burn Loop
   
@@ -110,17 +343,8 @@ List BReg(arma::mat X,   // RHS variables
     
     Rcpp::checkUserInterrupt();
     
-    v_1   = trans(X)*X+Lam;
-    v_1   = (trans(v_1)+v_1)/2;
-    v_1   = inv_sympd(v_1);
-    Mu    = v_1*(trans(X)*Y+Lam*trans(Bp));
-    scale = eye(k,k)+trans(Y-X*Mu)*(Y-X*Mu)+trans(Mu-trans(Bp))*Lam*(Mu-trans(Bp)); // eye(k) is the prior scale parameter for the IW distribution and eye(k)+junk the posterior.
-    scale = (scale+trans(scale))/2;
     q     = rinvwish(1,nu+T,scale); // Draw for q
-    mu    = vectorise(trans(Mu));   // vectorized posterior mean for beta
-    V_1   = kron(v_1,q);            // covariance of vectorized parameters beta
-    Beta  = mvrnrm(1,mu,V_1);       //Draw for B
-    B     = reshape(Beta,k,m);      //recovering original dimensions
+    B     = mnrnrm_chol(trans(Mu), U, chol(q, "lower")); //Draw for B, vectorise(B) ~ N(vectorise(Mu'), kron(inv(X'X+Lam), q))
   }
   
   //Sampling Loop
@@ -129,17 +353,8 @@ List BReg(arma::mat X,   // RHS variables
     
     Rcpp::checkUserInterrupt();
     
-    v_1   = trans(X)*X+Lam;
-    v_1   = (trans(v_1)+v_1)/2;
-    v_1   = inv_sympd(v_1);
-    Mu    = v_1*(trans(X)*Y+Lam*trans(Bp));
-    scale = eye(k,k)+trans(Y-X*Mu)*(Y-X*Mu)+trans(Mu-trans(Bp))*Lam*(Mu-trans(Bp)); // eye(k) is the prior scale parameter for the IW distribution and eye(k)+junk the posterior.
-    scale = (scale+trans(scale))/2;
     q     = rinvwish(1,nu+T,scale); // Draw for q
-    mu    = vectorise(trans(Mu));   // vectorized posterior mean for beta
-    V_1   = kron(v_1,q);            // covariance of vectorized parameters beta
-    Beta  = mvrnrm(1,mu,V_1);       //Draw for B
-    B     = reshape(Beta,k,m);      //recovering original dimensions
+    B     = mnrnrm_chol(trans(Mu), U, chol(q, "lower")); //Draw for B
     Qstore.slice(rep) = q;
     Bstore.slice(rep) = B;
   }
@@ -197,7 +412,7 @@ List BReg_diag(arma::mat X,   // RHS variables
   
   //declairing variables
   cube Bstore(k,m,reps);
-  mat v_1, Beta, Qstore(k,reps), xx;
+  mat U, Beta, Qstore(k,reps), xx;
   vec mu, q(k,fill::zeros);
   double scl;
   uvec ind_rm, ind;
@@ -227,13 +442,12 @@ List BReg_diag(arma::mat X,   // RHS variables
         y.shed_row(ind(n-1));
       }
       
-      v_1   = trans(xx)*xx+Lam;
-      v_1   = (trans(v_1)+v_1)/2;
-      v_1   = inv_sympd(v_1);
-      mu    = v_1*(trans(xx)*y+Lam*trans(Bp.row(j)));
+      U     = trans(xx)*xx+Lam;     //posterior precision
+      U     = chol((trans(U)+U)/2);  //and its Cholesky factor
+      mu    = chol_solve(U, trans(xx)*y+Lam*trans(Bp.row(j)));
       scl   = as_scalar(trans(y-xx*mu)*(y-xx*mu)+trans(mu-trans(Bp.row(j)))*Lam*(mu-trans(Bp.row(j)))); // prior variance is zero... a little odd but it works
       q(j)  = invchisq(nu(j)+y.n_rows,scl); //Draw for r
-      Beta  = mvrnrm(1, mu, v_1*q(j));
+      Beta  = mvrnrm_chol(1, mu, U, q(j));
       B.row(j) = trans(Beta.col(0));
     }
     
@@ -254,13 +468,12 @@ List BReg_diag(arma::mat X,   // RHS variables
         xx.shed_row(ind(n-1));
         y.shed_row(ind(n-1));
       }
-      v_1   = trans(xx)*xx+Lam;
-      v_1   = (trans(v_1)+v_1)/2;
-      v_1   = inv_sympd(v_1);
-      mu    = v_1*(trans(xx)*y+Lam*trans(Bp.row(j)));
+      U     = trans(xx)*xx+Lam;     //posterior precision
+      U     = chol((trans(U)+U)/2);  //and its Cholesky factor
+      mu    = chol_solve(U, trans(xx)*y+Lam*trans(Bp.row(j)));
       scl   = as_scalar(trans(y-xx*mu)*(y-xx*mu)+trans(mu-trans(Bp.row(j)))*Lam*(mu-trans(Bp.row(j)))); // prior variance is zero... a little odd but it works
       q(j)  = invchisq(nu(j)+y.n_rows,scl); //Draw for r
-      Beta  = mvrnrm(1, mu, v_1*q(j));
+      Beta  = mvrnrm_chol(1, mu, U, q(j));
       B.row(j) = trans(Beta.col(0));
     }
     Qstore.col(rep)   = q;
@@ -292,6 +505,988 @@ List BReg_diag(arma::mat X,   // RHS variables
 }
 
 
+// Find the unique patterns of missing values in Y (rows are periods)
+ObsPatterns obs_patterns(const arma::mat& Y){
+  uword T = Y.n_rows;
+  uword k = Y.n_cols;
+  ObsPatterns pat;
+  pat.id.set_size(T);
+  pat.miss = find_nonfinite(Y);
+  std::map<std::vector<bool>, uword> seen;
+  std::vector<uvec> ind;
+  std::vector<bool> mask(k);
+  for(uword t=0; t<T; t++){
+    for(uword j=0; j<k; j++){
+      mask[j] = std::isfinite(Y(t,j));
+    }
+    std::map<std::vector<bool>, uword>::iterator it = seen.find(mask);
+    if(it == seen.end()){
+      it = seen.insert(std::make_pair(mask, (uword)ind.size())).first;
+      ind.push_back(find_finite(Y.row(t)));
+    }
+    pat.id(t) = it->second;
+  }
+  uword n_pat = ind.size();
+  pat.ind.set_size(n_pat);
+  pat.periods.set_size(n_pat);
+  for(uword j=0; j<n_pat; j++){
+    pat.ind(j)     = ind[j];
+    pat.periods(j) = find(pat.id == j);
+  }
+  return(pat);
+}
+
+// Build observation matrices for each pattern of missing values. Only what the chosen
+// filter needs is built.
+void obs_mats(ObsMats& om,
+              const ObsPatterns& pat,
+              const arma::sp_mat& HJ,
+              const arma::mat& R,
+              bool univariate,
+              bool collapse){
+  uword n_pat = pat.ind.n_elem;
+  om.HJd = HJ;
+  if(om.H.n_elem != n_pat){
+    om.H.set_size(n_pat);
+  }
+  if(collapse){
+    if(om.W.n_elem != n_pat){
+      om.Ri.set_size(n_pat);
+      om.W.set_size(n_pat);
+    }
+    om.ldR.zeros(n_pat);
+  }else if(univariate){
+    if(om.Rd.n_elem != n_pat){
+      om.Rd.set_size(n_pat);
+    }
+  }else{
+    if(om.R.n_elem != n_pat){
+      om.R.set_size(n_pat);
+    }
+  }
+  for(uword j=0; j<n_pat; j++){
+    const uvec& ind = pat.ind(j);
+    uword n = ind.n_elem;
+    if(n == 0){
+      continue;
+    }
+    om.H(j) = om.HJd.rows(ind);
+    if(collapse){
+      om.Ri(j).set_size(n);
+      for(uword i=0; i<n; i++){
+        om.Ri(j)(i)  = 1/R(ind(i),ind(i));
+        om.ldR(j)   += std::log(R(ind(i),ind(i)));
+      }
+      // W = Hn'R^-1*Hn, filled element by element into the memory of om.W(j)
+      const mat& Hn = om.H(j);
+      mat& W        = om.W(j);
+      W.set_size(Hn.n_cols, Hn.n_cols);
+      for(uword b = 0; b < Hn.n_cols; b++){
+        for(uword a = 0; a <= b; a++){
+          double v = 0;
+          for(uword i = 0; i < n; i++){
+            v += Hn(i,a)*om.Ri(j)(i)*Hn(i,b);
+          }
+          W(a,b) = v;
+          W(b,a) = v;
+        }
+      }
+    }else if(univariate){
+      om.Rd(j).set_size(n);
+      for(uword i=0; i<n; i++){
+        om.Rd(j)(i) = R(ind(i),ind(i));
+      }
+    }else{
+      om.R(j)   = R(ind,ind);
+    }
+  }
+}
+
+// Allocating version; the one above reuses the memory of om when it holds matrices of the same model
+ObsMats obs_mats(const ObsPatterns& pat,
+                 const arma::sp_mat& HJ,
+                 const arma::mat& R,
+                 bool univariate,
+                 bool collapse){
+  ObsMats om;
+  obs_mats(om, pat, HJ, R, univariate, collapse);
+  return(om);
+}
+
+Companion companion(const arma::mat& Bc){
+  Companion A;
+  A.Bc = Bc;
+  A.m  = Bc.n_rows;
+  A.sA = Bc.n_cols;
+  return(A);
+}
+
+// Find the companion structure of a general transition matrix: the smallest m such that rows m
+// onward are [I 0]. If there is none m = sA and the kernels below reduce to dense products.
+Companion find_companion(const arma::sp_mat& A){
+  mat   Ad(A);
+  uword sA = Ad.n_rows;
+  uword m  = 1;
+  for(; m<sA; m++){
+    if(accu(abs(Ad.rows(m,sA-1) - join_horiz(eye<mat>(sA-m,sA-m), zeros<mat>(sA-m,m)))) == 0){
+      break;
+    }
+  }
+  return(companion(Ad.rows(0,m-1)));
+}
+
+// A*z
+arma::vec comp_Az(const Companion& A,
+                  const arma::vec& z){
+  vec Az(A.sA);
+  Az.head(A.m) = A.Bc*z;
+  if(A.sA > A.m){
+    Az.tail(A.sA-A.m) = z.head(A.sA-A.m);
+  }
+  return(Az);
+}
+
+// In place version, Az = A*z for Az other than z, written element by element so that no temporary
+// is formed for the product with Bc
+void comp_Az(arma::vec& Az,
+             const Companion& A,
+             const arma::vec& z){
+  uword m  = A.m;
+  uword sA = A.sA;
+  Az.set_size(sA);
+  Az.head(m).zeros();
+  for(uword c = 0; c < sA; c++){
+    for(uword i = 0; i < m; i++){
+      Az(i) += A.Bc(i,c)*z(c);
+    }
+  }
+  for(uword i = m; i < sA; i++){
+    Az(i) = z(i-m);
+  }
+}
+
+// r*A for a row vector r
+arma::rowvec comp_rA(const Companion& A,
+                     const arma::rowvec& r){
+  rowvec rA = r.head(A.m)*A.Bc;
+  if(A.sA > A.m){
+    rA.head(A.sA-A.m) += r.tail(A.sA-A.m);
+  }
+  return(rA);
+}
+
+// In place version, rA = r*A for r row t of X
+void comp_rA(arma::rowvec& rA,
+             const Companion& A,
+             const arma::mat& X,
+             arma::uword t){
+  uword m  = A.m;
+  uword sA = A.sA;
+  rA.set_size(sA);
+  for(uword c = 0; c < sA; c++){
+    double v = c+m < sA ? X(t,c+m) : 0;
+    for(uword i = 0; i < m; i++){
+      v += X(t,i)*A.Bc(i,c);
+    }
+    rA(c) = v;
+  }
+}
+
+// A*X
+arma::mat comp_AX(const Companion& A,
+                  const arma::mat& X){
+  mat AX(A.sA, X.n_cols);
+  AX.rows(0,A.m-1) = A.Bc*X;
+  if(A.sA > A.m){
+    AX.rows(A.m,A.sA-1) = X.rows(0,A.sA-A.m-1);
+  }
+  return(AX);
+}
+
+// A*P*A' + Q
+arma::mat comp_APA(const Companion& A,
+                   const arma::mat& P,
+                   const arma::sp_mat& Q){
+  mat AP = comp_AX(A, P);
+  mat APA(A.sA, A.sA);
+  APA.cols(0,A.m-1) = AP*trans(A.Bc);
+  if(A.sA > A.m){
+    APA.cols(A.m,A.sA-1) = AP.cols(0,A.sA-A.m-1); //contiguous copy of columns
+  }
+  return(APA + Q);
+}
+
+// In place version of A*P*A' + Q for symmetric P, with BP = Bc*P as work. Only the top m x m block
+// needs a product, and it is computed on and above the diagonal, so APA is exactly symmetric.
+void comp_APA(arma::mat& APA,
+              arma::mat& BP,
+              const Companion& A,
+              const arma::mat& P,
+              const arma::sp_mat& Q){
+  uword m  = A.m;
+  uword sA = A.sA;
+  BP = A.Bc*P;
+  APA.set_size(sA,sA);
+  for(uword c = 0; c < m; c++){
+    for(uword r = 0; r <= c; r++){
+      double v = 0;
+      for(uword l = 0; l < sA; l++){
+        v += BP(r,l)*A.Bc(c,l);
+      }
+      APA(r,c) = v;
+      APA(c,r) = v;
+    }
+  }
+  for(uword c = m; c < sA; c++){
+    for(uword r = 0; r < m; r++){
+      APA(r,c) = BP(r,c-m);
+      APA(c,r) = BP(r,c-m);
+    }
+    for(uword r = m; r < sA; r++){
+      APA(r,c) = P(r-m,c-m);
+    }
+  }
+  for(sp_mat::const_iterator it = Q.begin(); it != Q.end(); ++it){
+    APA(it.row(), it.col()) += *it;
+  }
+}
+
+// A'*X*A for symmetric X
+arma::mat comp_AtXA(const Companion& A,
+                    const arma::mat& X){
+  uword m  = A.m;
+  uword sA = A.sA;
+  mat XA = X.cols(0,m-1)*A.Bc;
+  if(sA > m){
+    XA.cols(0,sA-m-1) += X.cols(m,sA-1);
+  }
+  mat AXA = trans(A.Bc)*XA.rows(0,m-1);
+  if(sA > m){
+    AXA.rows(0,sA-m-1) += XA.rows(m,sA-1);
+  }
+  return(AXA);
+}
+
+// Gain for the univariate (sequential) measurement update with diagonal R, see Durbin and Koopman
+// (2012) section 6.4. Observations in a period are processed one at a time, so no inverse of S is
+// needed. The variance is updated in place. Gains and inverse variances of each scalar observation
+// are returned; ld is the sum of log variances. None of this depends on the data. PH is work of
+// the size of the state.
+void UVgain(arma::mat& P,         // predicted variance on entry, filtered variance on return
+            arma::mat& K,         // gains, one column per observation
+            arma::mat& Fi,        // inverse variances of prediction errors (n x 1)
+            double& ld,
+            const arma::mat& Hn,  // rows of HJ corresponding to observations
+            const arma::vec& Rn,  // diagonal of R corresponding to observations
+            arma::vec& PH){
+  uword n  = Hn.n_rows;
+  uword sA = P.n_rows;
+  double f, h;
+  K.zeros(sA, n);
+  Fi.zeros(n, 1);
+  PH.set_size(sA);
+  ld = 0;
+  for(uword i = 0; i<n; i++){
+    PH.zeros();
+    f = Rn(i);
+    for(uword c = 0; c<sA; c++){ //rows of HJ are mostly zeros
+      h = Hn(i,c);
+      if(h != 0){
+        PH += h*P.col(c);
+      }
+    }
+    for(uword c = 0; c<sA; c++){
+      f += Hn(i,c)*PH(c);
+    }
+    if(f > 0){
+      Fi(i)    = 1/f;
+      K.col(i) = PH/f;
+      for(uword c = 0; c<sA; c++){ //P - K.col(i)*trans(PH)
+        P.col(c) -= PH(c)*K.col(i);
+      }
+      ld       = ld + log(f);
+    }
+  }
+  sym_avg(P);
+}
+
+void UVgain(arma::mat& P,
+            arma::mat& K,
+            arma::mat& Fi,
+            double& ld,
+            const arma::mat& Hn,
+            const arma::vec& Rn){
+  vec PH;
+  UVgain(P, K, Fi, ld, Hn, Rn, PH);
+}
+
+// Data step of the univariate update given gains from UVgain. The state is updated in place and
+// prediction errors returned. Return value is the quadratic part of the log likelihood.
+double UVfilter(arma::vec& Z,         // predicted state on entry, filtered state on return
+                arma::vec& PE,        // prediction errors
+                const arma::mat& K,
+                const arma::mat& Fi,
+                const arma::mat& Hn,
+                const arma::vec& Yn){
+  uword n = Yn.n_elem;
+  double lik = 0, hz;
+  PE.zeros(n);
+  for(uword i = 0; i<n; i++){
+    hz = 0;
+    for(uword c = 0; c<Z.n_elem; c++){
+      hz += Hn(i,c)*Z(c);
+    }
+    PE(i) = Yn(i) - hz;
+    if(Fi(i) > 0){
+      Z  += PE(i)*K.col(i);
+      lik = lik - .5*PE(i)*PE(i)*Fi(i);
+    }
+  }
+  return(lik);
+}
+
+// Univariate measurement update. The state and its variance are updated in place. Gains, prediction
+// errors and inverse variances of each scalar observation are returned for smoothing; the return
+// value is the log likelihood of the period.
+double UVupdate(arma::vec& Z,
+                arma::mat& P,
+                arma::mat& K,
+                arma::vec& PE,
+                arma::vec& Fi,
+                const arma::mat& Hn,
+                const arma::vec& Rn,
+                const arma::vec& Yn){
+  double ld;
+  UVgain(P, K, Fi, ld, Hn, Rn);
+  return(-.5*ld + UVfilter(Z, PE, K, Fi, Hn, Yn));
+}
+
+// Backward step of the univariate smoother, in place: r for the start of a period given r for the
+// start of the next period times A (i.e. the r_{t,n} of Durbin and Koopman).
+void UVsmooth(arma::rowvec& r,
+              const arma::mat& K,
+              const arma::vec& PE,
+              const arma::mat& Fi,
+              const arma::mat& Hn){
+  double a;
+  for(uword i = PE.n_elem; i>0; i--){
+    a = PE(i-1)*Fi(i-1);
+    for(uword c = 0; c<r.n_elem; c++){
+      a -= r(c)*K(c,i-1);
+    }
+    for(uword c = 0; c<r.n_elem; c++){
+      r(c) += a*Hn(i-1,c);
+    }
+  }
+}
+
+// Gain for the collapsed measurement update with diagonal R (Jungbacker and Koopman 2015).
+// Observations enter only through b = Hn'R^-1*Yn, so given W = Hn'R^-1*Hn the work in each period
+// depends on the size of the state and not the number of series. The variance is updated in place
+// to P0 = P1*(I + W*P1)^-1; Gi = (I + W*P1)^-1 and ld = log|I + W*P1| are returned.
+//
+// With P1 = C'C and M = I + C*W*C' this is P0 = C'M^-1*C, Gi = I - W*P0 and ld = log|M|, which
+// need only Cholesky factors and a symmetric inverse, done in place in C and M. If P1 or M is not
+// numerically positive definite the general inverse of I + W*P1 is used.
+void CLgain(arma::mat& P,        // predicted variance on entry, filtered variance on return
+            arma::mat& Gi,
+            double& ld,
+            const arma::mat& W,  // Hn'R^-1*Hn
+            arma::mat& C,        // work of the size of P
+            arma::mat& M){       // work of the size of P
+  if(chol(C, P)){
+    Gi = C*W;
+    M  = Gi*trans(C);
+    M.diag() += 1;
+    sym_avg(M);
+    if(chol(Gi, M)){
+      ld = 0;
+      for(uword i = 0; i < Gi.n_rows; i++){
+        ld += 2*std::log(Gi(i,i));
+      }
+      M  = inv_sympd(M);
+      Gi = M*C;
+      P  = trans(C)*Gi;
+      sym_avg(P);
+      Gi = W*P;
+      Gi *= -1;
+      Gi.diag() += 1;
+      return;
+    }
+  }
+  double sgn;
+  M  = W*P;
+  M.diag() += 1;
+  log_det(ld, sgn, M);  // log|S| = log|R| + log|I + W*P|
+  Gi = inv(M);
+  C  = P*Gi;
+  P  = C;
+  sym_avg(P);
+}
+
+void CLgain(arma::mat& P,
+            arma::mat& Gi,
+            double& ld,
+            const arma::mat& W){
+  mat C, M;
+  CLgain(P, Gi, ld, W, C, M);
+}
+
+// Data step of the collapsed update given P0 and Gi from CLgain. The state is updated in place and
+// u = Hn'S^-1*PE is returned for smoothing, so that r(t-1) = u' + r(t)*A*(I - P0*W). Return
+// value is the log likelihood of the period. e and Pe are work of the size of the state.
+double CLfilter(arma::vec& Z,         // predicted state on entry, filtered state on return
+                arma::vec& u,
+                const arma::mat& P0,
+                const arma::mat& Gi,
+                double ld,
+                const arma::mat& W,   // Hn'R^-1*Hn
+                const arma::vec& b,   // Hn'R^-1*Yn
+                double yRy,           // Yn'R^-1*Yn
+                double ldR,           // log determinant of observed rows/cols of R
+                arma::vec& e,
+                arma::vec& Pe){
+  e   = b;
+  e  -= W*Z;
+  double vRv = yRy - dot(Z,b) - dot(Z,e); // PE'R^-1*PE, as Z'W*Z = Z'b - Z'e
+  Pe  = P0*e;
+  u   = Gi*e;
+  Z  += Pe;
+  return(-.5*(ldR + ld + vRv - dot(e,Pe)));
+}
+
+// Collapsed measurement update. The state and its variance are updated in place; u and PW = P0*W
+// are returned for smoothing. Return value is the log likelihood of the period.
+double CLupdate(arma::vec& Z,
+                arma::mat& P,
+                arma::vec& u,
+                arma::mat& PW,
+                const arma::mat& W,
+                const arma::vec& b,
+                double yRy,
+                double ldR){
+  mat Gi;
+  vec e, Pe;
+  double ld;
+  CLgain(P, Gi, ld, W);
+  PW = P*W;
+  return(CLfilter(Z, u, P, Gi, ld, W, b, yRy, ldR, e, Pe));
+}
+
+// Gain for the multivariate measurement update. The variance is updated in place; the gain K, S^-1
+// and ld = log|S| are returned. PH, S and C are work of sizes sA x n, n x n and n x n for n
+// observations, and may be views of larger buffers.
+void MVgain(arma::mat& P,         // predicted variance on entry, filtered variance on return
+            arma::mat& K,
+            arma::mat& Si,
+            double& ld,
+            const arma::mat& Hn,  // rows of HJ corresponding to observations
+            const arma::mat& Rn,  // rows and columns of R corresponding to observations
+            arma::mat& PH,
+            arma::mat& S,
+            arma::mat& C){
+  PH  = P*trans(Hn);
+  S   = Hn*PH;
+  S  += Rn; //variance of Yp
+  sym_avg(S);
+  if(!chol(C, S)){
+    throw std::runtime_error("Variance of the prediction errors is not positive definite");
+  }
+  ld  = 0;
+  for(uword i = 0; i < C.n_rows; i++){
+    ld += 2*std::log(C(i,i));
+  }
+  Si  = inv_sympd(S);
+  K   = PH*Si;       //Kalman gain
+  P  -= K*trans(PH); // variance Z(t+1)|Y(1:t+1), as Hn*P1 = PH'
+  sym_avg(P);
+}
+
+// Observed elements ind of row t of Y, gathered into Yn without a copy of the whole row
+void obs_row(arma::vec& Yn,
+             const arma::mat& Y,
+             arma::uword t,
+             const arma::uvec& ind){
+  Yn.set_size(ind.n_elem);
+  for(uword i = 0; i < ind.n_elem; i++){
+    Yn(i) = Y(t,ind(i));
+  }
+}
+
+// Size the vectors of w for a state of size sA and k series. Memory is kept if the sizes are unchanged.
+void kf_work(KFWork& w,
+             arma::uword sA,
+             arma::uword k){
+  uword n = std::max(k, sA);
+  w.yk.set_size(n);
+  w.pk.set_size(n);
+  w.ek.set_size(n);
+  w.rk.set_size(n);
+}
+
+// Measurement update of the predicted state Z, in place, with the gain K, Si and ld from kf_gain and
+// the observations Yn of pattern j. The prediction error (u for collapsed filtering) is written to
+// PE and the return value is the log likelihood of the period. w must be sized by kf_work.
+double KFmean(arma::vec& Z,
+              arma::vec& PE,
+              const arma::mat& K,
+              const arma::mat& Si,
+              double ld,
+              const ObsMats& om,
+              arma::uword j,
+              const arma::vec& Yn,
+              bool univariate,
+              bool collapse,
+              KFWork& w){
+  uword n = Yn.n_elem;
+  vec Yr(w.rk.memptr(), n, false, true); // R^-1*Yn (collapsed) or S^-1*PE, in the memory of w.rk
+  if(collapse){
+    for(uword i = 0; i < n; i++){
+      Yr(i) = Yn(i)*om.Ri(j)(i);
+    }
+    w.b = trans(om.H(j))*Yr;
+    return(CLfilter(Z, PE, K, Si, ld, om.W(j), w.b, dot(Yn,Yr), om.ldR(j), w.e, w.Pe));
+  } else if(univariate){
+    return(-.5*ld + UVfilter(Z, PE, K, Si, om.H(j), Yn));
+  } else{
+    PE  = Yn;
+    PE -= om.H(j)*Z; // prediction error
+    Z  += K*PE;      //updating step for Z
+    Yr  = Si*PE;
+    return(-.5*ld - .5*dot(PE,Yr));
+  }
+}
+
+// The same with the gain of slot s of kf
+double KFmean(arma::vec& Z,
+              arma::vec& PE,
+              const FilterOut& kf,
+              arma::uword s,
+              const ObsMats& om,
+              arma::uword j,
+              const arma::vec& Yn,
+              bool univariate,
+              bool collapse,
+              KFWork& w){
+  return(KFmean(Z, PE, kf.K(s), kf.Si(s), kf.ld(s), om, j, Yn, univariate, collapse, w));
+}
+
+double KFmean(arma::vec& Z,
+              arma::vec& PE,
+              const FilterOut& kf,
+              arma::uword s,
+              const ObsMats& om,
+              arma::uword j,
+              const arma::vec& Yn,
+              bool univariate,
+              bool collapse){
+  KFWork w;
+  kf_work(w, Z.n_elem, Yn.n_elem);
+  return(KFmean(Z, PE, kf, s, om, j, Yn, univariate, collapse, w));
+}
+
+// Measurement update of the variance for pattern j, in place: P1 on entry, P0 on return. The gain
+// is written to K, Si and ld as stored in FilterOut: K and S^-1 (multivariate), the gains and 1/F
+// of each observation (univariate), or P0 and (I + W*P1)^-1 (collapsed), with ld = log|S| (less
+// log|R| if collapsed).
+void kf_gain(arma::mat& P,
+             arma::mat& K,
+             arma::mat& Si,
+             double& ld,
+             const ObsMats& om,
+             arma::uword j,
+             bool univariate,
+             bool collapse,
+             KFWork& w){
+  uword sA = P.n_rows;
+  if(collapse){
+    CLgain(P, Si, ld, om.W(j), w.C, w.M);
+    K = P;
+  } else if(univariate){
+    UVgain(P, K, Si, ld, om.H(j), om.Rd(j), w.ph);
+  } else{
+    // work for up to k observations, viewed at the number observed
+    uword k = om.HJd.n_rows;
+    uword n = om.H(j).n_rows;
+    if(w.PHk.n_rows != sA || w.PHk.n_cols != k){
+      w.PHk.set_size(sA,k);
+      w.Sk.set_size(k,k);
+      w.Ck.set_size(k,k);
+    }
+    mat PH(w.PHk.memptr(), sA, n, false, true);
+    mat S(w.Sk.memptr(), n, n, false, true);
+    mat C(w.Ck.memptr(), n, n, false, true);
+    MVgain(P, K, Si, ld, om.H(j), om.R(j), PH, S, C);
+  }
+}
+
+// One period of the filter, in place: the measurement update of the predicted state Z and variance
+// P with the observations Yn of pattern j, then the prediction of both for the next period. The
+// filtered state is left in w.Zu and the filtered variance in w.P0. The gain is written to K, Si
+// and ld by kf_gain, unless fixed is true (a steady state), in which case the gain given is used
+// and P is not changed. Prediction errors are written to PE. Returns the log likelihood of the
+// period. w must be sized by kf_work.
+double kf_step(arma::vec& Z,
+               arma::mat& P,
+               arma::vec& PE,
+               arma::mat& K,
+               arma::mat& Si,
+               double& ld,
+               bool fixed,
+               const Companion& A,
+               const arma::sp_mat& Q,
+               const arma::vec& Yn,
+               const ObsMats& om,
+               arma::uword j,
+               bool univariate,
+               bool collapse,
+               KFWork& w){
+  double lik = 0;
+  w.Zu = Z;
+  if(!fixed){
+    w.P0 = P;
+  }
+  if(Yn.n_elem > 0){
+    if(!fixed){
+      kf_gain(w.P0, K, Si, ld, om, j, univariate, collapse, w);
+    }
+    lik = KFmean(w.Zu, PE, K, Si, ld, om, j, Yn, univariate, collapse, w);
+  }
+  comp_Az(Z, A, w.Zu); //prediction for Z(t+1)
+  if(!fixed){
+    comp_APA(P, w.BP, A, w.P0, Q); //variance Z(t+1)|Y(1:t)
+  }
+  return(lik);
+}
+
+// Length of the cycle of the patterns of missing values ending in period t: the smallest L up to
+// max_cycle for which the patterns of the last L periods are those of the L periods before them,
+// or 0 if there is none. A run of one pattern has L = 1; a monthly panel with quarterly series has
+// L = 3 away from the ends of the sample.
+arma::uword pattern_cycle(const ObsPatterns& pat,
+                          arma::uword t){
+  for(uword L = 1; L <= max_cycle && 2*L <= t+1; L++){
+    bool same = true;
+    for(uword i = 0; i < L && same; i++){
+      same = pat.id(t-i) == pat.id(t-i-L);
+    }
+    if(same){
+      return(L);
+    }
+  }
+  return(0);
+}
+
+// Kalman filter for the disturbance smoother, using multivariate, univariate or collapsed updates.
+// Gains depend only on the predicted variance P1 and the pattern of missing values, so they are
+// stored in slots. P1 is in a steady state once it is unchanged by a cycle of the patterns (a run
+// of one pattern, or e.g. the three months of a quarter in a monthly panel with quarterly series).
+// While the patterns keep repeating, each period then uses the slot of the period one cycle before
+// and skips the Riccati recursion, so the number of slots is about the length of the cycle times
+// the periods to convergence rather than T. Output is written to kf, reusing
+// its memory when it holds the output of a filter of the same size, and the recursions use the
+// memory of w.
+void KFilter(FilterOut& kf,
+             KFWork& w,
+             const Companion& A,     // companion form of transition matrix
+             const arma::sp_mat& Q,  // covariance matrix of shocks to states
+             const arma::vec& Zi,    // initial (predicted) state
+             const arma::mat& Pi,    // initial variance of the state
+             const arma::mat& Y,     // data
+             const ObsPatterns& pat,
+             const ObsMats& om,
+             bool univariate,
+             bool collapse){
+  uword T  = Y.n_rows;
+  uword k  = Y.n_cols;
+  uword sA = A.sA;
+  kf.Z.zeros(T,sA);
+  kf.Zp.zeros(T,sA);
+  if(kf.PE.n_elem != T){
+    kf.PE.set_size(T);
+    kf.K.set_size(T);
+    kf.Si.set_size(T);
+  }
+  kf.ld.zeros(T);
+  kf.slot.zeros(T);
+  kf.n_steady = 0;
+  kf.lik      = 0;
+  kf_work(w, sA, k);
+  if(w.P1c.n_elem != max_cycle){
+    w.P1c.set_size(max_cycle);
+  }
+  
+  w.P1 = Pi;
+  w.Zp = Zi;
+  uword j, n, s = 0, st, L = 0;
+  bool steady = false;
+  
+  for(uword t=0; t<T; t++) {
+    j = pat.id(t); //pattern of missing values in period t
+    n = pat.ind(j).n_elem;
+    kf.Zp.row(t) = trans(w.Zp);
+    // P1 of the period is kept for the steady state test. A steady state only holds while the
+    // patterns repeat those of L periods before, and P1 on leaving it is that of L periods before.
+    mat& P1t = w.P1c(t % max_cycle);
+    if(steady && pat.id(t-L) != j){
+      steady = false;
+      w.P1   = w.P1c((t-L) % max_cycle);
+    }
+    P1t = steady ? w.P1c((t-L) % max_cycle) : w.P1;
+    // observations and prediction errors of the period, in the memory of w
+    vec Yn(w.yk.memptr(), n, false, true);
+    vec PE(w.pk.memptr(), collapse ? sA : n, false, true);
+    obs_row(Yn, Y, t, pat.ind(j));
+    // gains are written straight into their slot, or in the steady state are those of L periods
+    // before, with the filtered and predicted variance
+    st = steady ? kf.slot(t-L) : s;
+    kf.lik     += kf_step(w.Zp, w.P1, PE, kf.K(st), kf.Si(st), kf.ld(st), steady, A, Q, Yn, om, j,
+                          univariate, collapse, w);
+    kf.Z.row(t) = trans(w.Zu);
+    if(n > 0){
+      kf.PE(t)   = PE;
+      kf.slot(t) = st;
+      if(steady){
+        kf.n_steady++;
+      } else{
+        s++;
+      }
+    }
+    // predicted state and variance for the next row, if they are to be saved. In the steady state
+    // P1 is not updated, and the predicted variance is that of L periods before.
+    if(t+1 == kf.snap){
+      kf.Zsnap = w.Zp;
+      kf.Psnap = steady ? w.P1c((t+1-L) % max_cycle) : w.P1;
+    }
+    // P1 has converged if it is unchanged by a cycle of the patterns
+    if(!steady && t+1<T){
+      L = pattern_cycle(pat, t+1);
+      steady = L > 0 && norm_inf(w.P1, w.P1c((t+1-L) % max_cycle), 1) <=
+                        ss_tol*norm_inf(w.P1, w.P1, 0);
+    }
+  }
+}
+
+void KFilter(FilterOut& kf,
+             const Companion& A,
+             const arma::sp_mat& Q,
+             const arma::vec& Zi,
+             const arma::mat& Pi,
+             const arma::mat& Y,
+             const ObsPatterns& pat,
+             const ObsMats& om,
+             bool univariate,
+             bool collapse){
+  KFWork w;
+  KFilter(kf, w, A, Q, Zi, Pi, Y, pat, om, univariate, collapse);
+}
+
+// Filter starting from a state of zero
+void KFilter(FilterOut& kf,
+             const Companion& A,
+             const arma::sp_mat& Q,
+             const arma::mat& Pi,
+             const arma::mat& Y,
+             const ObsPatterns& pat,
+             const ObsMats& om,
+             bool univariate,
+             bool collapse){
+  KFilter(kf, A, Q, zeros<vec>(A.sA), Pi, Y, pat, om, univariate, collapse);
+}
+
+// Filter means only, for data with the patterns of missing values filtered into kf. The gains in kf
+// do not depend on the data, so Z, Zp, PE and the likelihood are recomputed for Y from the initial
+// state Zi without the variance recursion.
+void KFmeans(FilterOut& kf,
+             const Companion& A,
+             const arma::vec& Zi,
+             const arma::mat& Y,
+             const ObsPatterns& pat,
+             const ObsMats& om,
+             bool univariate,
+             bool collapse){
+  KFWork w;
+  kf_work(w, A.sA, Y.n_cols);
+  vec Zp = Zi, Zu, Yn, PE;
+  uword j;
+  kf.lik = 0;
+  for(uword t=0; t<Y.n_rows; t++){
+    j  = pat.id(t);
+    kf.Zp.row(t) = trans(Zp);
+    Zu = Zp;
+    if(!pat.ind(j).is_empty()){
+      obs_row(Yn, Y, t, pat.ind(j));
+      kf.lik   += KFmean(Zu, PE, kf, kf.slot(t), om, j, Yn, univariate, collapse, w);
+      kf.PE(t)  = PE;
+    }
+    kf.Z.row(t) = trans(Zu);
+    comp_Az(Zp, A, Zu);
+  }
+}
+
+FilterOut KFilter(const Companion& A,
+                  const arma::sp_mat& Q,
+                  const arma::mat& Pi,
+                  const arma::mat& Y,
+                  const ObsPatterns& pat,
+                  const ObsMats& om,
+                  bool univariate,
+                  bool collapse){
+  FilterOut kf;
+  KFilter(kf, A, Q, Pi, Y, pat, om, univariate, collapse);
+  return(kf);
+}
+
+// Backward pass of the disturbance smoother (Durbin and Koopman 2001/2012) given filter output.
+// r is 1 indexed (row t is r(t-1) in the book's notation) and is written in place, with the
+// recursion using the memory of w.
+void DSback(arma::mat& r,
+            KFWork& w,
+            const FilterOut& kf,
+            const Companion& A,
+            const ObsPatterns& pat,
+            const ObsMats& om,
+            bool univariate,
+            bool collapse){
+  uword T  = kf.Z.n_rows;
+  uword sA = A.sA;
+  r.zeros(T+1,sA);
+  kf_work(w, sA, om.HJd.n_rows);
+  uword j, n, s, s_W = T; //T is never a slot
+  
+  //r is 1 indexed while all other variables are zero indexed
+  for(uword t=T; t>0; t--) {
+    j  = pat.id(t-1);
+    n  = pat.ind(j).n_elem;
+    s  = kf.slot(t-1);
+    comp_rA(w.rA, A, r, t);
+    if(n == 0){
+      r.row(t-1) = w.rA; //nothing observed
+    }else if(collapse){
+      if(s != s_W){ //a run of one pattern shares a slot in the steady state, so keep the last one
+        w.PW = kf.K(s)*om.W(j);
+        s_W  = s;
+      }
+      w.rB = w.rA*w.PW;
+      const vec& u = kf.PE(t-1);
+      for(uword c = 0; c < sA; c++){
+        r(t-1,c) = u(c) + w.rA(c) - w.rB(c);
+      }
+    }else if(univariate){
+      UVsmooth(w.rA, kf.K(s), kf.PE(t-1), kf.Si(s), om.H(j));
+      r.row(t-1) = w.rA;
+    }else{
+      // r(t)*L with L = A - A*K*Hn, without forming L: (S^-1*PE - (r(t)*A*K)')'*Hn + r(t)*A
+      vec    e(w.ek.memptr(), n, false, true);
+      rowvec rK(w.rk.memptr(), n, false, true);
+      e    = kf.Si(s)*kf.PE(t-1);
+      rK   = w.rA*kf.K(s);
+      for(uword i = 0; i < n; i++){
+        e(i) -= rK(i);
+      }
+      w.rB = trans(e)*om.H(j);
+      for(uword c = 0; c < sA; c++){
+        r(t-1,c) = w.rA(c) + w.rB(c);
+      }
+    }
+  }
+}
+
+void DSback(arma::mat& r,
+            const FilterOut& kf,
+            const Companion& A,
+            const ObsPatterns& pat,
+            const ObsMats& om,
+            bool univariate,
+            bool collapse){
+  KFWork w;
+  DSback(r, w, kf, A, pat, om, univariate, collapse);
+}
+
+arma::mat DSback(const FilterOut& kf,
+                 const Companion& A,
+                 const ObsPatterns& pat,
+                 const ObsMats& om,
+                 bool univariate,
+                 bool collapse){
+  mat r;
+  DSback(r, kf, A, pat, om, univariate, collapse);
+  return(r);
+}
+
+// State smoother for EM estimation with diagonal R. The forward pass is the collapsed filter of
+// KFilter. The backward pass is the state smoothing recursion of Durbin and Koopman (2012, section
+// 4.4) in terms of the filtered variance P0 and G = (I + W*P1)^-1 from the filter:
+// r(t-1) = u(t) + G*A'r(t) and N(t-1) = W*G' + G*A'N(t)A*G', so no variance is inverted. Smoothed
+// variances are not stored; the sums EM needs are accumulated as the pass runs. Memory is one
+// sA x sA matrix per filter slot, and slots are shared once the filter reaches its steady state,
+// including the periodic one of a mixed frequency panel.
+void EMsmooth(EMStats& st,
+              const Companion& A,
+              const arma::sp_mat& Q,
+              const arma::mat& Pi,    // initial variance of the state
+              const arma::mat& Y,     // data
+              const ObsPatterns& pat,
+              const ObsMats& om,      // collapsed observation matrices
+              arma::uword m){         // size of the block summed by pattern
+  uword T  = Y.n_rows;
+  uword sA = A.sA;
+  FilterOut kf;
+  KFilter(kf, A, Q, Pi, Y, pat, om, false, true);
+  st.lik = kf.lik;
+  st.Zf  = kf.Z;
+  st.Zp  = kf.Zp;
+  st.Z.set_size(T,sA);
+  st.V.zeros(sA,sA);
+  st.Vm.set_size(pat.ind.n_elem);
+  for(uword j = 0; j < pat.ind.n_elem; j++){
+    st.Vm(j).zeros(m,m);
+  }
+
+  vec r(sA, fill::zeros), Ar;
+  mat N(sA, sA, fill::zeros), AP, ANA, V;
+  field<mat> Pe;  // variances for a run of periods with nothing observed (filtered = predicted)
+  uword e0 = T;   // first period of that run
+  uword j;
+  bool obs;
+  for(uword t = T; t-- > 0;){
+    j   = pat.id(t);
+    obs = !pat.ind(j).is_empty();
+    if(!obs && e0 > t){
+      // the filter does not keep variances of periods with nothing observed, so find those of
+      // this run again from the filtered variance before it
+      e0 = t;
+      while(e0 > 0 && pat.ind(pat.id(e0-1)).is_empty()){
+        e0--;
+      }
+      Pe.set_size(t-e0+1);
+      mat P = e0 == 0 ? Pi : comp_APA(A, kf.K(kf.slot(e0-1)), Q);
+      for(uword s = e0; s <= t; s++){
+        Pe(s-e0) = symmatu((P+trans(P))/2);
+        P        = comp_APA(A, Pe(s-e0), Q);
+      }
+    }
+    const mat& P0 = obs ? kf.K(kf.slot(t)) : Pe(t-e0);
+    AP  = comp_AX(A, P0);
+    st.Z.row(t) = kf.Z.row(t) + trans(trans(AP)*r);  // a(t|t) + P0*A'r(t)
+    V   = P0 - trans(AP)*N*AP;                         // P0 - P0*A'N(t)*A*P0
+    st.V     += V;
+    st.Vm(j) += V.submat(0,0,m-1,m-1);
+
+    Ar  = trans(comp_rA(A, trans(r)));
+    ANA = comp_AtXA(A, N);
+    if(obs){
+      const mat& G = kf.Si(kf.slot(t));
+      r = kf.PE(t) + G*Ar;
+      N = om.W(j)*trans(G) + G*ANA*trans(G);
+      N = symmatu((N+trans(N))/2);
+    }else{
+      r = Ar;
+      N = ANA;
+    }
+  }
+}
+
 // Disturbance smoother. Output is a list.
 // [[Rcpp::export]]
 List DSmooth(      arma::mat B,     // companion form of transition matrix
@@ -301,7 +1496,28 @@ List DSmooth(      arma::mat B,     // companion form of transition matrix
                    arma::mat R,     // covariance matrix of shocks to observables; Y are observations
                    arma::mat Y,     //data
                    arma::uvec freq,  // frequency of each series (# low freq. periods in one obs)
-                   arma::uvec LD){   // 0 if level, 1 if one diff.
+                   arma::uvec LD,    // 0 if level, 1 if one diff.
+                   bool univariate = false, // process observations one at a time (R must be diagonal)
+                   bool collapse = false,    // collapse observations to the size of the state (R must be diagonal)
+                   int keep = -1,            // series (from 0) for which to return contributions to updates, if any
+                   bool store_gains = false){ // also return gains and prediction errors for each period
+  return(DSmooth(B, Jb, q, H, R, Y, freq, LD, univariate, collapse, keep, store_gains, obs_patterns(Y)));
+}
+
+// Disturbance smoother given the patterns of missing values in Y
+List DSmooth(      const arma::mat& B,
+                   const arma::sp_mat& Jb,
+                   const arma::mat& q,
+                   const arma::mat& H,
+                   const arma::mat& R,
+                   const arma::mat& Y,
+                   const arma::uvec& freq,
+                   const arma::uvec& LD,
+                   bool univariate,
+                   bool collapse,
+                   int keep,
+                   bool store_gains,
+                   const ObsPatterns& pat){
   
   
   // preliminaries
@@ -311,19 +1527,17 @@ List DSmooth(      arma::mat B,     // companion form of transition matrix
   uword k  = H.n_rows; //number of observables
   uword sA = m*p; //size of companion matrix A
   
-  // For frequencies that do not change rows of HJ will be fixed.
-  sp_mat HJ(k,sA);
-  mat    hj;
-  for(uword j = 0; j<k; j++){
-    hj  = H(j,span::all)*J_MF(freq(j), m, LD(j), sA);
-    HJ  = sprow(HJ,hj,j); //replace row j of HJ with vector hj
+  if(univariate && collapse){
+    stop("Choose at most one of univariate and collapsed filtering");
   }
+  if((univariate || collapse) && accu(abs(R - diagmat(R))) > 0){
+    stop("Univariate and collapsed filtering require a diagonal R");
+  }
+  
+  sp_mat HJ = mf_HJ(H, mf_cache(freq, LD, m, sA));
   
-  //Making the A matrix
-  sp_mat BJb    = MakeSparse(B*Jb);
-  sp_mat tmp_sp(sA-m,m);
-  tmp_sp = join_horiz(speye<sp_mat>(sA-m,sA-m), tmp_sp);
-  sp_mat A      = join_vert(BJb, tmp_sp);
+  //Making the A matrix (companion form, stored as its top m rows)
+  Companion A   = companion(mat(B*Jb));
   
   //Making the Q matrix
   mat qq(sA,sA,fill::zeros);
@@ -331,88 +1545,93 @@ List DSmooth(      arma::mat B,     // companion form of transition matrix
   sp_mat Q(qq);
   
   //Using the long run variance
-  mat P0, P1, S, C;
-  mat XX(eye<mat>(sA*sA, sA*sA) - kron(A,A));
-  mat vQ(reshape(Q, sA*sA, 1));
-  mat tmp_P = solve(XX, vQ);
-  mat Pi(reshape(tmp_P, sA, sA));
-  P0  = Pi; //long run variance
-  P1  = P0;
-  
-  //Declairing variables for the filter
-  field<mat> Kstr(T); //store Kalman gain
-  field<vec> PEstr(T); //store prediction error
-  field<mat> Hstr(T), Sstr(T); //store H and S^-1
-  mat VarY, ZP(T+1,sA,fill::zeros), Z(T,sA,fill::zeros), Zs(T,sA,fill::zeros), Lik, K, Rn, Si, tmp_mat;
-  sp_mat Hn;
-  vec PE, Yt, Yn, Yp;
-  uvec ind, indM;
-  double tmp;
-  double tmpp;
-  Lik << 0;
-  vec Zp(sA, fill::zeros); //initialize to zero --- more or less arbitrary due to difuse variance
-  
-  mat zippo(1,1,fill::zeros);
-  mat zippo_sA(sA,1);
+  mat Pi = Lyapunov(comp_form(A.Bc), mat(Q));
+  
+  //Observation matrices for each pattern of missing values
+  ObsMats om = obs_mats(pat, HJ, R, univariate, collapse);
   
   // -------- Filtering --------------------
-  for(uword t=0; t<T; t++) {
-    //Allowing for missing Y values
-    Yt     = trans(Y.row(t));
-    ind    = find_finite(Yt);
-    Yn     = Yt(ind);
-    // if nothing is observed
-    if(Yn.is_empty()){
-      Z.row(t) = trans(Zp);
-      P0       = P1;
-      Hstr(t)  = trans(zippo_sA);
-      Sstr(t)  = zippo;
-      PEstr(t) = zippo;
-      Kstr(t)  = zippo_sA;
-    } else{
-      //if variables are observed
-      Hn        = sp_rows(HJ,ind); //rows of HJ corresponding to observations
-      Hstr(t)   = Hn; //Store for smoothing
-      Rn        = R.rows(ind);  //rows of R corresponding to observations
-      Rn        = Rn.cols(ind); //cols of R corresponding to observations
-      Yp        = Hn*Zp; //prediction step for Y
-      S         = Hn*P1*trans(Hn)+Rn; //variance of Yp
-      S         = symmatu((S+trans(S))/2); //enforce pos. semi. def.
-      Si        = inv_sympd(S); //invert S
-      Sstr(t)   = Si; //sotre Si for smoothing
-      K         = P1*trans(Hn)*Si; //Kalman gain
-      PE        = Yn-Yp; // prediction error
-      PEstr(t)  = PE; //store prediction error
-      Kstr(t)   = K;  //store Kalman gain
-      Z.row(t)  = trans(Zp+K*PE); //updating step for Z
-      P0        = P1-P1*trans(Hn)*Si*Hn*P1; // variance Z(t+1)|Y(1:t+1)
-      P0        = symmatu((P0+trans(P0))/2); //enforce pos semi def
-      log_det(tmp,tmpp,S); //calculate log determinant of S for the likelihood
-      Lik    = -.5*tmp-.5*trans(PE)*Si*PE+Lik; //calculate log likelihood
-    }
-    // Prediction for next period
-    Zp  = A*trans(Z.row(t)); //prediction for Z(t+1) +itcZ
-    ZP.row(t+1) = trans(Zp);
-    P1     = A*P0*trans(A)+Q; //variance Z(t+1)|Y(1:t)
-    P1     = symmatu((P1+trans(P1))/2); //enforce pos semi def
-  }
-  ZP.shed_row(T);
+  FilterOut kf = KFilter(A, Q, Pi, Y, pat, om, univariate, collapse);
   
   //Smoothing following Durbin Koopman 2001/2012
-  mat r(T+1,sA,fill::zeros);
-  mat L;
+  mat r = DSback(kf, A, pat, om, univariate, collapse);
   
-  //r is 1 indexed while all other variables are zero indexed
-  for(uword t=T; t>0; t--) {
-    L     = (A-A*Kstr(t-1)*Hstr(t-1));
-    r.row(t-1) = trans(PEstr(t-1))*Sstr(t-1)*Hstr(t-1) + r.row(t)*L;
+  if(keep >= (int)k){
+    stop("keep must index a series in Y");
+  }
+  
+  //Contributions of each observation to the update of each factor, K(f,i)*PE(i) for the gain K and
+  //prediction error PE of the period, and of each observation to the update of the fitted value of
+  //series keep. Unobserved series are NA. Gains are only kept for all periods if requested.
+  cube Fup(T, k, m);
+  Fup.fill(NA_REAL);
+  mat Iup;
+  if(keep >= 0){
+    Iup.set_size(T, k);
+    Iup.fill(NA_REAL);
+  }
+  field<mat> Kstr;  //store Kalman gain
+  field<vec> PEstr; //store prediction error
+  if(store_gains){
+    Kstr.set_size(T);
+    PEstr.set_size(T);
+  }
+  rowvec hj;
+  if(keep >= 0){
+    hj = rowvec(HJ.row(keep));
+  }
+  mat Kt, KPE, L;
+  vec PEt, Yn;
+  uword j;
+  for(uword t=0; t<T; t++){
+    j = pat.id(t);
+    if(pat.ind(j).is_empty()){
+      if(store_gains){
+        PEstr(t).zeros(1);
+        Kstr(t).zeros(sA,1);
+      }
+      continue;
+    }else if(collapse || univariate){
+      //the filter stores other gains and innovations, so the multivariate ones are recovered
+      obs_row(Yn, Y, t, pat.ind(j));
+      PEt = Yn - om.H(j)*trans(kf.Zp.row(t));
+      if(collapse){
+        Kt = kf.K(kf.slot(t))*trans(om.H(j).each_col() % om.Ri(j)); //P1*Hn'*S^-1 = P0*Hn'*R^-1
+      }else{
+        //sequential gains Ks apply to sequential innovations PEs, where PE = L*PEs for L unit lower
+        //triangular with L(i,l) = Hn(i)*Ks(l), l < i. So K*PE = Ks*PEs gives K = Ks*L^-1.
+        const mat& Ks = kf.K(kf.slot(t));
+        L  = trimatl(om.H(j)*Ks);
+        L.diag().ones();
+        Kt = trans(solve(trimatu(trans(L)), trans(Ks)));
+      }
+    }else{
+      PEt = kf.PE(t);
+      Kt  = kf.K(kf.slot(t));
+    }
+    KPE = Kt.each_row() % trans(PEt);
+    for(uword f = 0; f < m; f++){
+      for(uword i = 0; i < pat.ind(j).n_elem; i++){
+        Fup(t, pat.ind(j)(i), f) = KPE(f,i);
+      }
+    }
+    if(keep >= 0){
+      Iup.submat(uvec({t}), pat.ind(j)) = hj*KPE;
+    }
+    if(store_gains){
+      PEstr(t) = PEt;
+      Kstr(t)  = Kt;
+    }
   }
+  mat Lik(1,1);
+  Lik(0,0) = kf.lik;
+  mat Zs(T,sA);
   
   Zs.row(0)   = r.row(0)*Pi;
   
   //Forward again
   for(uword t = 0; t<T-1; t++){
-    Zs.row(t+1)   = Zs.row(t)*trans(A) + r.row(t+1)*Q; //smoothed values of Z
+    Zs.row(t+1)   = trans(comp_Az(A, trans(Zs.row(t)))) + r.row(t+1)*Q; //smoothed values of Z
   }
   
   mat Ys = Zs*trans(HJ); //fitted values of Y
@@ -420,16 +1639,415 @@ List DSmooth(      arma::mat B,     // companion form of transition matrix
   List Out;
   Out["Ys"]   = Ys;
   Out["Lik"]  = Lik;
-  Out["Zz"]   = Z;
+  Out["Zz"]   = kf.Z;
   Out["Z"]    = Zs;
-  Out["Zp"]   = ZP;
-  Out["Kstr"] = Kstr;
-  Out["PEstr"]= PEstr;
+  Out["Zp"]   = kf.Zp;
+  Out["factor_update"] = Fup;
+  if(keep >= 0){
+    Out["idx_update"] = Iup;
+  }
+  if(store_gains){
+    Out["Kstr"] = Kstr;
+    Out["PEstr"]= PEstr;
+  }
   Out["r"]    = r;
+  Out["n_steady"] = kf.n_steady; //periods using steady state gains
   
   return(Out);
 }
 
+// Initial state for FilterState and DSupdate: zero with the long run variance if Zi and Pi are empty
+void start_state(arma::vec& Z,
+                 arma::mat& P,
+                 const Companion& A,
+                 const arma::sp_mat& Q){
+  if(Z.is_empty()){
+    Z.zeros(A.sA);
+  }
+  if(P.is_empty()){
+    P = Lyapunov(comp_form(A.Bc), mat(Q));
+  }
+  if(Z.n_elem != A.sA || P.n_rows != A.sA || P.n_cols != A.sA){
+    stop("Initial state does not match the size of the model");
+  }
+}
+
+// Filter from the predicted state Z with variance P for the first row of Y to the predicted state
+// and variance for the period after its last row, in place, one kf_step per row as in KFilter. om
+// holds collapsed observation matrices if collapse is true (R diagonal) and multivariate ones
+// otherwise. Returns the log likelihood.
+double advance_state(arma::vec& Z,
+                     arma::mat& P,
+                     const Companion& A,
+                     const arma::sp_mat& Q,
+                     const arma::mat& Y,
+                     const ObsPatterns& pat,
+                     const ObsMats& om,
+                     bool collapse){
+  KFWork w;
+  kf_work(w, A.sA, Y.n_cols);
+  uword sA = A.sA;
+  uword j, n;
+  double lik = 0, ld = 0;
+  for(uword t = 0; t < Y.n_rows; t++){
+    j = pat.id(t);
+    n = pat.ind(j).n_elem;
+    vec Yn(w.yk.memptr(), n, false, true);
+    vec PE(w.pk.memptr(), collapse ? sA : n, false, true);
+    obs_row(Yn, Y, t, pat.ind(j));
+    lik += kf_step(Z, P, PE, w.K, w.Si, ld, false, A, Q, Yn, om, j, false, collapse, w);
+  }
+  return(lik);
+}
+
+// Filter state saved for DSupdate: the predicted state and its variance for the period after the last
+// row of Y, starting from the predicted state Zi with variance Pi for its first row. Empty Zi and Pi
+// start from zero with the long run variance, as in DSmooth.
+// Called from R by dfm_state (R/dfm-update.R).
+// [[Rcpp::export]]
+List FilterState(         arma::mat B,     // transition matrix
+                          arma::sp_mat Jb, // helper matrix for transition equation
+                          arma::mat q,     // covariance matrix of shocks to states
+                          arma::mat H,     // measurement equation
+                          arma::mat R,     // covariance matrix of shocks to observables
+                          arma::mat Y,     // data, up to the last period that will not be revised
+                          arma::uvec freq, // frequency of each seres
+                          arma::uvec LD,   // 0 for levels, 1 for first difference
+                          arma::vec Zi,    // predicted state for the first row of Y
+                          arma::mat Pi){   // and its variance
+  uword m  = B.n_rows;
+  uword sA = Jb.n_cols;
+  sp_mat HJ   = mf_HJ(H, mf_cache(freq, LD, m, sA));
+  Companion A = companion(mat(B*Jb));
+  mat qq(sA,sA,fill::zeros);
+  qq(span(0,m-1),span(0,m-1)) = q;
+  sp_mat Q(qq);
+  start_state(Zi, Pi, A, Q);
+  bool collapse   = accu(abs(R - diagmat(R))) == 0;
+  ObsPatterns pat = obs_patterns(Y);
+  ObsMats om      = obs_mats(pat, HJ, R, false, collapse);
+  double lik      = advance_state(Zi, Pi, A, Q, Y, pat, om, collapse);
+
+  List Out;
+  Out["Z"]   = Zi;
+  Out["P"]   = Pi;
+  Out["Lik"] = lik;
+  return(Out);
+}
+
+// Update of a fitted model for new data releases. Y holds only the periods after the state saved by
+// FilterState (new and revised observations, and periods to forecast). The filter starts from the
+// saved state and the smoother runs back over these rows only, so the cost does not depend on the
+// length of the history. Earlier periods are taken as final. The state advanced through the first
+// n_safe rows of Y, which will not be revised, is saved by the same filter pass and returned for the
+// next update. Called from R by dfm_update (R/dfm-update.R).
+// [[Rcpp::export]]
+List DSupdate(            arma::mat B,     // transition matrix
+                          arma::sp_mat Jb, // helper matrix for transition equation
+                          arma::mat q,     // covariance matrix of shocks to states
+                          arma::mat H,     // measurement equation
+                          arma::mat R,     // covariance matrix of shocks to observables
+                          arma::mat Y,     // data after the saved state
+                          arma::uvec freq, // frequency of each seres
+                          arma::uvec LD,   // 0 for levels, 1 for first difference
+                          arma::vec Zi,    // saved predicted state for the first row of Y
+                          arma::mat Pi,    // and its variance
+                          arma::uword n_safe = 0, // rows of Y to add to the saved state
+                          bool univariate = false, // process observations one at a time (R must be diagonal)
+                          bool collapse = false){  // collapse observations to the size of the state (R must be diagonal)
+  uword T  = Y.n_rows;
+  uword m  = B.n_rows;
+  uword sA = Jb.n_cols;
+
+  if(univariate && collapse){
+    stop("Choose at most one of univariate and collapsed filtering");
+  }
+  if((univariate || collapse) && accu(abs(R - diagmat(R))) > 0){
+    stop("Univariate and collapsed filtering require a diagonal R");
+  }
+  if(T == 0 || n_safe > T){
+    stop("Y must have at least one row, and at least n_safe rows");
+  }
+
+  sp_mat HJ   = mf_HJ(H, mf_cache(freq, LD, m, sA));
+  Companion A = companion(mat(B*Jb));
+  mat qq(sA,sA,fill::zeros);
+  qq(span(0,m-1),span(0,m-1)) = q;
+  sp_mat Q(qq);
+  start_state(Zi, Pi, A, Q);
+
+  ObsPatterns pat = obs_patterns(Y);
+  ObsMats om      = obs_mats(pat, HJ, R, univariate, collapse);
+
+  // Filter from the saved state, keeping the state after the first n_safe rows for the next update,
+  // then smooth back to the saved state
+  FilterOut kf;
+  kf.snap = n_safe;
+  KFilter(kf, A, Q, Zi, Pi, Y, pat, om, univariate, collapse);
+  mat r = DSback(kf, A, pat, om, univariate, collapse);
+  mat Zs(T,sA);
+  Zs.row(0) = trans(Zi) + r.row(0)*Pi;
+  for(uword t = 0; t<T-1; t++){
+    Zs.row(t+1) = trans(comp_Az(A, trans(Zs.row(t)))) + r.row(t+1)*Q; //smoothed values of Z
+  }
+
+  // Saved state for the next update
+  vec Zn = n_safe > 0 ? kf.Zsnap : Zi;
+  mat Pn = n_safe > 0 ? kf.Psnap : Pi;
+  List state;
+  state["Z"] = Zn;
+  state["P"] = Pn;
+
+  List Out;
+  Out["Ys"]    = Zs*trans(HJ); //fitted values of Y
+  Out["Z"]     = Zs;
+  Out["Zz"]    = kf.Z;
+  Out["Lik"]   = kf.lik;
+  Out["state"] = state;
+  return(Out);
+}
+
+// Smoothed states given the output of KFilter (or KFmeans) started from the predicted state Zi with
+// variance Pi
+arma::mat DSstates(const FilterOut& kf,
+                   const Companion& A,
+                   const arma::sp_mat& Q,
+                   const arma::vec& Zi,
+                   const arma::mat& Pi,
+                   const ObsPatterns& pat,
+                   const ObsMats& om,
+                   bool univariate,
+                   bool collapse){
+  uword T = kf.Z.n_rows;
+  mat r = DSback(kf, A, pat, om, univariate, collapse);
+  mat Zs(T, A.sA);
+  Zs.row(0) = trans(Zi) + r.row(0)*Pi;
+  for(uword t = 0; t<T-1; t++){
+    Zs.row(t+1) = trans(comp_Az(A, trans(Zs.row(t)))) + r.row(t+1)*Q; //smoothed values of Z
+  }
+  return(Zs);
+}
+
+// Effect of each series of D on the smoothed value hj*Z, for data with the patterns filtered into kf.
+// Given the gains the smoother is linear in the data, so the effect of series i is the smoother run
+// from a zero state on column i of D alone. Series with no non-zero elements are skipped. The means
+// in kf are overwritten.
+arma::mat news_by_series(FilterOut& kf,
+                         const Companion& A,
+                         const arma::sp_mat& Q,
+                         const arma::mat& Pi,
+                         const arma::mat& D,
+                         const arma::rowvec& hj,
+                         const ObsPatterns& pat,
+                         const ObsMats& om,
+                         bool univariate,
+                         bool collapse){
+  uword T = D.n_rows;
+  uword k = D.n_cols;
+  mat out(T, k, fill::zeros);
+  vec Z0(A.sA, fill::zeros);
+  mat Di(T, k);
+  for(uword i = 0; i < k; i++){
+    if(!any(D.col(i))){
+      continue;
+    }
+    Di.zeros();
+    Di.col(i) = D.col(i);
+    KFmeans(kf, A, Z0, Di, pat, om, univariate, collapse);
+    out.col(i) = DSstates(kf, A, Q, Z0, Pi, pat, om, univariate, collapse)*trans(hj);
+  }
+  return(out);
+}
+
+// Change in the fitted values of series target from one vintage of the data to the next, decomposed
+// into the contributions of each series' new releases and revisions (Banbura and Modugno 2014) for
+// fixed parameters. The vintages share a filter pass up to n_back rows before the first row in which
+// they differ, and only the rows from there on are smoothed, so the cost is proportional to the
+// changed region. With the common observations C (observed in both vintages):
+//   news:      Ys(new) - Ys(C, new values). New releases enter through their innovations given C.
+//   revisions: Ys(C, new values) - Ys(C, old values), less the effect of observations in the old
+//              vintage only, which enter through their innovations given C in the same way.
+// Contributions are for rows start, start+1, ... of Y (from 1) and sum to Ys_new - Ys_old.
+// Rows before start are filtered once, so without a saved state a call costs a filter pass over the
+// whole history. Given a state saved by FilterState or DSupdate, the vintages hold only the rows
+// after it, as for DSupdate, and the cost no longer depends on the length of the history.
+// [[Rcpp::export]]
+List DSnews(              arma::mat B,      // transition matrix
+                          arma::sp_mat Jb,  // helper matrix for transition equation
+                          arma::mat q,      // covariance matrix of shocks to states
+                          arma::mat H,      // measurement equation
+                          arma::mat R,      // covariance matrix of shocks to observables
+                          arma::mat Y_old,  // earlier vintage of the data
+                          arma::mat Y_new,  // later vintage; either may have more rows
+                          arma::uvec freq,  // frequency of each seres
+                          arma::uvec LD,    // 0 for levels, 1 for first difference
+                          arma::uword target,       // series (from 0) whose fitted values are decomposed
+                          arma::uword n_back = 0,   // rows before the first change to include
+                          bool univariate = false,  // process observations one at a time (R must be diagonal)
+                          bool collapse = false,    // collapse observations to the size of the state (R must be diagonal)
+                          Rcpp::Nullable<Rcpp::List> state = R_NilValue){ // saved state (Z, P) for the first row of Y
+  uword k  = H.n_rows;
+  uword m  = B.n_rows;
+  uword sA = Jb.n_cols;
+  uword T  = std::max(Y_old.n_rows, Y_new.n_rows);
+
+  if(univariate && collapse){
+    stop("Choose at most one of univariate and collapsed filtering");
+  }
+  bool diag_R = accu(abs(R - diagmat(R))) == 0;
+  if((univariate || collapse) && !diag_R){
+    stop("Univariate and collapsed filtering require a diagonal R");
+  }
+  if(Y_old.n_cols != k || Y_new.n_cols != k){
+    stop("Both vintages must have one column for each row of H");
+  }
+  if(target >= k){
+    stop("target must index a series in Y");
+  }
+
+  // vintages with the same number of rows; later periods are missing in the shorter one
+  mat Yo(T, k), Yn(T, k);
+  Yo.fill(datum::nan);
+  Yn.fill(datum::nan);
+  if(Y_old.n_rows > 0){
+    Yo.rows(0, Y_old.n_rows-1) = Y_old;
+  }
+  if(Y_new.n_rows > 0){
+    Yn.rows(0, Y_new.n_rows-1) = Y_new;
+  }
+
+  // first row in which the vintages differ
+  uword t0 = T;
+  bool a, b;
+  for(uword t = 0; t < T && t0 == T; t++){
+    for(uword i = 0; i < k; i++){
+      a = std::isfinite(Yo(t,i));
+      b = std::isfinite(Yn(t,i));
+      if(a != b || (a && Yo(t,i) != Yn(t,i))){
+        t0 = t;
+        break;
+      }
+    }
+  }
+  uword s  = t0 - std::min(n_back, t0);
+  uword Tr = T - s;
+
+  sp_mat HJ   = mf_HJ(H, mf_cache(freq, LD, m, sA));
+  rowvec hj   = rowvec(HJ.row(target));
+  Companion A = companion(mat(B*Jb));
+  mat qq(sA,sA,fill::zeros);
+  qq(span(0,m-1),span(0,m-1)) = q;
+  sp_mat Q(qq);
+  vec Zi;
+  mat Pi;
+  if(state.isNotNull()){
+    List st(state.get());
+    Zi = as<vec>(st["Z"]);
+    Pi = as<mat>(st["P"]);
+  }
+  start_state(Zi, Pi, A, Q);
+
+  List Out;
+  Out["start"] = s+1;
+  if(Tr == 0){
+    Out["Ys_old"]      = vec();
+    Out["Ys_new"]      = vec();
+    Out["news"]        = mat(0, k);
+    Out["revisions"]   = mat(0, k);
+    Out["innovations"] = mat(0, k);
+    Out["revised"]     = mat(0, k);
+    return(Out);
+  }
+
+  // common prefix, filtered once for both vintages
+  if(s > 0){
+    mat Yp          = Yo.rows(0, s-1);
+    ObsPatterns pat = obs_patterns(Yp);
+    ObsMats om      = obs_mats(pat, HJ, R, false, diag_R);
+    advance_state(Zi, Pi, A, Q, Yp, pat, om, diag_R);
+  }
+  Yo = Yo.rows(s, T-1);
+  Yn = Yn.rows(s, T-1);
+
+  // common observations, and what changed
+  mat Yc_old = Yo, Yc_new = Yn;
+  mat Dr(Tr, k, fill::zeros), Dn(Tr, k, fill::zeros), Dw(Tr, k, fill::zeros);
+  mat revised(Tr, k), innovations(Tr, k);
+  revised.fill(NA_REAL);
+  innovations.fill(NA_REAL);
+  bool withdrawn = false;
+  for(uword t = 0; t < Tr; t++){
+    for(uword i = 0; i < k; i++){
+      a = std::isfinite(Yo(t,i));
+      b = std::isfinite(Yn(t,i));
+      if(a && b){
+        Dr(t,i)      = Yn(t,i) - Yo(t,i);
+        revised(t,i) = Dr(t,i);
+      }else if(a){
+        Yc_old(t,i) = datum::nan;
+        withdrawn   = true;
+      }else if(b){
+        Yc_new(t,i) = datum::nan;
+      }
+    }
+  }
+
+  // smoothing the common observations
+  ObsPatterns pat_c = obs_patterns(Yc_new);
+  ObsMats om_c      = obs_mats(pat_c, HJ, R, univariate, collapse);
+  FilterOut kf_c;
+  KFilter(kf_c, A, Q, Zi, Pi, Yc_new, pat_c, om_c, univariate, collapse);
+  mat Yfit_c = DSstates(kf_c, A, Q, Zi, Pi, pat_c, om_c, univariate, collapse)*trans(HJ);
+  KFmeans(kf_c, A, Zi, Yc_old, pat_c, om_c, univariate, collapse);
+  mat Zc_old = DSstates(kf_c, A, Q, Zi, Pi, pat_c, om_c, univariate, collapse);
+
+  // new vintage, and the innovations of new releases given the common observations
+  ObsPatterns pat_n = obs_patterns(Yn);
+  ObsMats om_n      = obs_mats(pat_n, HJ, R, univariate, collapse);
+  FilterOut kf_n;
+  KFilter(kf_n, A, Q, Zi, Pi, Yn, pat_n, om_n, univariate, collapse);
+  vec Ys_new = DSstates(kf_n, A, Q, Zi, Pi, pat_n, om_n, univariate, collapse)*trans(hj);
+  for(uword t = 0; t < Tr; t++){
+    for(uword i = 0; i < k; i++){
+      if(std::isfinite(Yn(t,i)) && !std::isfinite(Yc_new(t,i))){
+        Dn(t,i)          = Yn(t,i) - Yfit_c(t,i);
+        innovations(t,i) = Dn(t,i);
+      }
+    }
+  }
+  mat news      = news_by_series(kf_n, A, Q, Pi, Dn, hj, pat_n, om_n, univariate, collapse);
+  mat revisions = news_by_series(kf_c, A, Q, Pi, Dr, hj, pat_c, om_c, univariate, collapse);
+
+  // old vintage; observations it has that the new one does not are counted as revisions
+  vec Ys_old;
+  if(withdrawn){
+    mat Yfit_o = Zc_old*trans(HJ);
+    for(uword t = 0; t < Tr; t++){
+      for(uword i = 0; i < k; i++){
+        if(std::isfinite(Yo(t,i)) && !std::isfinite(Yc_old(t,i))){
+          Dw(t,i) = Yo(t,i) - Yfit_o(t,i);
+        }
+      }
+    }
+    ObsPatterns pat_o = obs_patterns(Yo);
+    ObsMats om_o      = obs_mats(pat_o, HJ, R, univariate, collapse);
+    FilterOut kf_o;
+    KFilter(kf_o, A, Q, Zi, Pi, Yo, pat_o, om_o, univariate, collapse);
+    Ys_old     = DSstates(kf_o, A, Q, Zi, Pi, pat_o, om_o, univariate, collapse)*trans(hj);
+    revisions -= news_by_series(kf_o, A, Q, Pi, Dw, hj, pat_o, om_o, univariate, collapse);
+  }else{
+    Ys_old = Zc_old*trans(hj);
+  }
+
+  Out["Ys_old"]      = Ys_old;
+  Out["Ys_new"]      = Ys_new;
+  Out["news"]        = news;
+  Out["revisions"]   = revisions;
+  Out["innovations"] = innovations;
+  Out["revised"]     = revised;
+  return(Out);
+}
+
 //Disturbance smoothing --- output is only smoothed factors for simulations
 // [[Rcpp::export]]
 arma::mat DSMF(           arma::mat B,     // companion form of transition matrix
@@ -439,7 +2057,24 @@ arma::mat DSMF(           arma::mat B,     // companion form of transition matri
                           arma::mat R,     // covariance matrix of shocks to observables; Y are observations
                           arma::mat Y,     // data
                           arma::uvec freq, //frequency of each seres
-                          arma::uvec LD){  // 0 for levels, 1 for first difference
+                          arma::uvec LD,   // 0 for levels, 1 for first difference
+                          bool univariate = false, // process observations one at a time (R must be diagonal)
+                          bool collapse = false){   // collapse observations to the size of the state (R must be diagonal)
+  return(DSMF(B, Jb, q, H, R, Y, freq, LD, univariate, collapse, obs_patterns(Y)));
+}
+
+//Disturbance smoothing given the patterns of missing values in Y
+arma::mat DSMF(           const arma::mat& B,
+                          const arma::sp_mat& Jb,
+                          const arma::mat& q,
+                          const arma::mat& H,
+                          const arma::mat& R,
+                          const arma::mat& Y,
+                          const arma::uvec& freq,
+                          const arma::uvec& LD,
+                          bool univariate,
+                          bool collapse,
+                          const ObsPatterns& pat){
   
   
   // preliminaries
@@ -449,19 +2084,17 @@ arma::mat DSMF(           arma::mat B,     // companion form of transition matri
   uword k  = H.n_rows; //number of observables
   uword sA = m*p; //size of companion matrix A
   
-  // For frequencies that do not change rows of HJ will be fixed.
-  sp_mat HJ(k,sA);
-  mat    hj;
-  for(uword j = 0; j<k; j++){
-    hj  = H(j,span::all)*J_MF(freq(j), m, LD(j), sA);
-    HJ  = sprow(HJ,hj,j); //replace row j of HJ with vector hj
+  if(univariate && collapse){
+    throw std::runtime_error("Choose at most one of univariate and collapsed filtering");
   }
+  if((univariate || collapse) && accu(abs(R - diagmat(R))) > 0){
+    throw std::runtime_error("Univariate and collapsed filtering require a diagonal R");
+  }
+  
+  sp_mat HJ = mf_HJ(H, mf_cache(freq, LD, m, sA));
   
-  //Making the A matrix
-  sp_mat BJb    = MakeSparse(B*Jb);
-  sp_mat tmp_sp(sA-m,m);
-  tmp_sp = join_horiz(speye<sp_mat>(sA-m,sA-m), tmp_sp);
-  sp_mat A      = join_vert(BJb, tmp_sp);
+  //Making the A matrix (companion form, stored as its top m rows)
+  Companion A   = companion(mat(B*Jb));
   
   //Making the Q matrix
   mat qq(sA,sA,fill::zeros);
@@ -469,94 +2102,202 @@ arma::mat DSMF(           arma::mat B,     // companion form of transition matri
   sp_mat Q(qq);
   
   //Using the long run variance
-  mat P0, P1, S, C;
-  mat XX(eye<mat>(sA*sA, sA*sA) - kron(A,A));
-  mat vQ(reshape(Q, sA*sA, 1));
-  mat tmp_P = solve(XX, vQ);
-  mat Pi(reshape(tmp_P, sA, sA));
-  P0  = Pi; //long run variance
-  P1  = P0;
-  
-  //Declairing variables for the filter
-  //mat P11 = P1; //output long run variancce for testing.
-  field<mat> Kstr(T); //store Kalman gain
-  field<vec> PEstr(T); //store prediction error
-  field<mat> Hstr(T), Sstr(T); //store H and S^-1
-  mat VarY, Z(T,sA,fill::zeros), Zs(T,sA,fill::zeros), Lik, K, Rn, Mn, Si, tmp_mat;
-  sp_mat Hn;
-  vec Z1, PE, Yt, Yn, Yp;
-  uvec ind, indM;
-  Lik << 0;
-  double tmp;
-  double tmpp;
-  vec Zp(sA,fill::zeros); //initial factor values (arbitrary as variance difuse)
-  
-  mat zippo(1,1,fill::zeros);
-  mat zippo_sA(sA,1,fill::zeros);
+  mat Pi = Lyapunov(comp_form(A.Bc), mat(Q));
   
-  // -------- Filtering --------------------
-  for(uword t=0; t<T; t++) {
-    //Allowing for missing Y values
-    Yt     = trans(Y.row(t));
-    ind    = find_finite(Yt);
-    Yn     = Yt(ind);
-    // if nothing is observed
-    if(Yn.is_empty()){
-      Z.row(t) = trans(Zp);
-      P0       = P1;
-      Hstr(t)  = trans(zippo_sA);
-      Sstr(t)  = zippo;
-      PEstr(t) = zippo;
-      Kstr(t)  = zippo_sA;
-    } else{
-      //if variables are observed
-      Hn        = sp_rows(HJ,ind);
-      Hstr(t)   = Hn;
-      Rn        = R.rows(ind);
-      Rn        = Rn.cols(ind);
-      Yp        = Hn*Zp; //prediction step for Y
-      S         = Hn*P1*trans(Hn)+Rn; //variance of Yp
-      S         = symmatu((S+trans(S))/2);
-      Si        = inv_sympd(S);
-      Sstr(t)   = Si;
-      K         = P1*trans(Hn)*Si; //Kalman Gain
-      PE        = Yn-Yp; // prediction error
-      PEstr(t)  = PE;
-      Kstr(t)   = K;
-      Z.row(t)  = trans(Zp+K*PE); //updating step for Z
-      P0        = P1-P1*trans(Hn)*Si*Hn*P1; // variance Z(t+1)|Y(1:t+1)
-      P0        = symmatu((P0+trans(P0))/2);
-      log_det(tmp,tmpp,S);
-      Lik    = -.5*tmp-.5*trans(PE)*Si*PE+Lik;
-      // Prediction for next period
-      Zp     = A*trans(Z.row(t)); //prediction for Z(t+1) +itcZ
-      //ZP.row(t) = trans(Zp);
-      P1     = A*P0*trans(A)+Q; //variance Z(t+1)|Y(1:t)
-      P1     = symmatu((P1+trans(P1))/2);
-    }
-  }
+  //Observation matrices for each pattern of missing values
+  ObsMats om = obs_mats(pat, HJ, R, univariate, collapse);
   
+  // -------- Filtering --------------------
+  FilterOut kf = KFilter(A, Q, Pi, Y, pat, om, univariate, collapse);
   
   //Smoothing
-  mat r(T+1,sA,fill::zeros);
-  mat L;
-  
-  //t is 1 indexed, all other vars are 0 indexed
-  for(uword t=T; t>0; t--) {
-    L     = (A-A*Kstr(t-1)*Hstr(t-1));
-    r.row(t-1) = trans(PEstr(t-1))*Sstr(t-1)*Hstr(t-1) + r.row(t)*L;
-  }
+  mat r = DSback(kf, A, pat, om, univariate, collapse);
+  mat Zs(T,sA);
   
   Zs.row(0)   = r.row(0)*Pi;
   
   //Forward again
   for(uword t = 0; t<T-1; t++){
-    Zs.row(t+1)   = Zs.row(t)*trans(A) + r.row(t+1)*Q;
+    Zs.row(t+1)   = trans(comp_Az(A, trans(Zs.row(t)))) + r.row(t+1)*Q;
   }
   return(Zs);
 }
 
 
+//Draw of the factors given the data: the mean corrected simulation smoother of Durbin and Koopman
+//(2002), equivalent to FSimMF followed by DSMF on Y - Yd. Doing both in one routine builds HJ, A,
+//Q and the initial variance once, and skips the simulated data that is never used.
+// [[Rcpp::export]]
+arma::mat SimSmooth(      arma::mat B,     // companion form of transition matrix
+                          arma::sp_mat Jb, // helper matrix for transition equation
+                          arma::mat q,     // covariance matrix of shocks to states
+                          arma::mat H,     // measurement equation
+                          arma::mat R,     // covariance matrix of shocks to observables; Y are observations
+                          arma::mat Y,     // data
+                          arma::uvec freq, //frequency of each seres
+                          arma::uvec LD,   // 0 for levels, 1 for first difference
+                          bool univariate = false, // process observations one at a time (R must be diagonal)
+                          bool collapse = false){   // collapse observations to the size of the state (R must be diagonal)
+  rng_stream rng(rng_seed());
+  return(SimSmooth(B, Jb, q, H, R, Y, freq, LD, univariate, collapse, obs_patterns(Y), rng));
+}
+
+//Simulation smoothing given the patterns of missing values in Y, drawing from the stream rng
+//(thread safe). Draws are taken in the same order as FSimMF.
+arma::mat SimSmooth(      const arma::mat& B,
+                          const arma::sp_mat& Jb,
+                          const arma::mat& q,
+                          const arma::mat& H,
+                          const arma::mat& R,
+                          const arma::mat& Y,
+                          const arma::uvec& freq,
+                          const arma::uvec& LD,
+                          bool univariate,
+                          bool collapse,
+                          const ObsPatterns& pat,
+                          rng_stream& rng){
+  DrawWork ws;
+  SimSmooth(ws, B, Jb, q, H, R, Y, freq, LD, univariate, collapse, pat, rng);
+  return(ws.Zd);
+}
+
+//Simulation smoothing using the memory in ws. The draw is left in ws.Zd.
+void SimSmooth(           DrawWork& ws,
+                          const arma::mat& B,
+                          const arma::sp_mat& Jb,
+                          const arma::mat& q,
+                          const arma::mat& H,
+                          const arma::mat& R,
+                          const arma::mat& Y,
+                          const arma::uvec& freq,
+                          const arma::uvec& LD,
+                          bool univariate,
+                          bool collapse,
+                          const ObsPatterns& pat,
+                          rng_stream& rng){
+  
+  
+  // preliminaries
+  uword T  = Y.n_rows; //number of time peridos
+  uword m  = B.n_rows; //number of factors
+  uword p  = Jb.n_cols/m; //number of lags (must agree with lev/diff structure of data)
+  uword k  = H.n_rows; //number of observables
+  uword sA = m*p; //size of companion matrix A
+  
+  //errors are thrown as std::runtime_error rather than with stop(), which calls R, as draws run in
+  //parallel regions
+  if(univariate && collapse){
+    throw std::runtime_error("Choose at most one of univariate and collapsed filtering");
+  }
+  if((univariate || collapse) && !R.is_diagmat()){
+    throw std::runtime_error("Univariate and collapsed filtering require a diagonal R");
+  }
+  
+  // Aggregation of the factors for each series is fixed for a model, so it is found on first use
+  if(ws.mf.id.n_elem != k || ws.mf.agg[0].sA != sA){
+    ws.mf = mf_cache(freq, LD, m, sA);
+  }
+  //Model matrices are written into ws in place
+  mf_HJ(ws.HJ, H, ws.mf);
+  
+  //Making the A matrix (companion form, stored as its top m rows)
+  ws.A.Bc = B*Jb;
+  ws.A.m  = m;
+  ws.A.sA = sA;
+  const Companion& A = ws.A;
+  
+  //Making the Q matrix
+  state_cov(ws.Q, q, sA);
+  
+  //Using the long run variance
+  ws.Af.zeros(sA,sA);
+  ws.Af.rows(0,m-1) = A.Bc;
+  if(sA > m){
+    ws.Af(span(m,sA-1),span(0,sA-m-1)).eye();
+  }
+  ws.Qd.zeros(sA,sA);
+  ws.Qd(span(0,m-1),span(0,m-1)) = q;
+  Lyapunov(ws.Pi, ws.Ak, ws.AP, ws.Af, ws.Qd);
+  
+  // -------- Simulation --------------------
+  //set_size() keeps the memory of buffers that are already the right size
+  ws.U.set_size(k,T);
+  ws.Ue.set_size(m,T);
+  ws.Zd.set_size(T,sA);
+  ws.Zs.set_size(T,sA);
+  ws.z.set_size(sA);
+  randn_stream(ws.U, rng);
+  //same draws as trans(mvrnrm(T,0,R))
+  if(R.is_diagmat()){
+    ws.Eps  = trans(ws.U);
+    for(uword j = 0; j < k; j++){
+      ws.Eps.col(j) *= std::sqrt(std::max(R(j,j), 0.0));
+    }
+  }else{
+    sqrt_psd(ws.Cr, ws.evr, R);
+    ws.Eps  = trans(ws.U)*trans(ws.Cr);
+  }
+  randn_stream(ws.Ue, rng);
+  sqrt_psd(ws.Cq, ws.evq, q);
+  ws.E    = trans(ws.Ue)*trans(ws.Cq);
+  randn_stream(ws.z, rng);
+  sqrt_psd(ws.C, ws.ev, ws.Pi);
+  ws.Az   = ws.C*ws.z; //same draw as mvrnrm(1, zeros<vec>(sA), Pi, rng)
+  ws.z    = ws.Az;      //copied rather than swapped so each buffer keeps its memory
+  for(uword t=0; t<T; t++) {
+    ws.Zd.row(t) = trans(ws.z);
+    comp_Az(ws.Az, A, ws.z);
+    for(uword i = 0; i < m; i++){
+      ws.z(i) = ws.Az(i) + ws.E(t,i);
+    }
+    for(uword i = m; i < sA; i++){
+      ws.z(i) = ws.Az(i);
+    }
+  }
+  //Data less simulated data. Missing values of Y remain missing. Zd*HJ' is subtracted one non-zero
+  //loading at a time, so no T x k product is formed.
+  ws.Ys  = Y - ws.Eps;
+  for(sp_mat::const_iterator it = ws.HJ.begin(); it != ws.HJ.end(); ++it){
+    ws.Ys.col(it.row()) -= (*it)*ws.Zd.col(it.col());
+  }
+  
+  // -------- Filtering --------------------
+  //Gains depend on the parameters and the pattern of missing values only, so one pass of the filter
+  //on Ys is all that is needed
+  obs_mats(ws.om, pat, ws.HJ, R, univariate, collapse);
+  ws.z.zeros(); //initial state
+  KFilter(ws.kf, ws.w, A, ws.Q, ws.z, ws.Pi, ws.Ys, pat, ws.om, univariate, collapse);
+  
+  //Smoothing
+  DSback(ws.r, ws.w, ws.kf, A, pat, ws.om, univariate, collapse);
+  for(uword c = 0; c < sA; c++){ //r.row(0)*Pi
+    double v = 0;
+    for(uword i = 0; i < sA; i++){
+      v += ws.r(0,i)*ws.Pi(i,c);
+    }
+    ws.Zs(0,c) = v;
+  }
+  
+  //Forward again, adding the simulated factors to the smoothed mean. r*Q only involves the top m
+  //elements of r, as Q = [q 0; 0 0].
+  for(uword t = 0; t<T-1; t++){
+    for(uword i = 0; i < sA; i++){
+      ws.z(i) = ws.Zs(t,i);
+    }
+    comp_Az(ws.Az, A, ws.z);
+    for(uword c = 0; c < sA; c++){
+      double v = ws.Az(c);
+      if(c < m){
+        for(uword i = 0; i < m; i++){
+          v += ws.r(t+1,i)*q(i,c);
+        }
+      }
+      ws.Zs(t+1,c) = v;
+    }
+  }
+  ws.Zd += ws.Zs;
+}
+
 //Forward recursion using draws for eps and e
 // [[Rcpp::export]]
 arma::field<arma::mat> FSimMF(    arma::mat B,     // companion form of transition matrix
@@ -567,6 +2308,22 @@ arma::field<arma::mat> FSimMF(    arma::mat B,     // companion form of transiti
                                   arma::mat Y,     // data
                                   arma::uvec freq, // frequency
                                   arma::uvec LD){  // level 0, or diff 1
+  rng_stream rng(rng_seed());
+  return(FSimMF(B, Jb, q, H, R, Y, freq, LD, obs_patterns(Y), rng));
+}
+
+//Forward recursion drawing from the stream rng (thread safe). Missing values in Y, given by
+//pat, are replicated in the simulated data.
+arma::field<arma::mat> FSimMF(    const arma::mat& B,
+                                  const arma::sp_mat& Jb,
+                                  const arma::mat& q,
+                                  const arma::mat& H,
+                                  const arma::mat& R,
+                                  const arma::mat& Y,
+                                  const arma::uvec& freq,
+                                  const arma::uvec& LD,
+                                  const ObsPatterns& pat,
+                                  rng_stream& rng){
   
   
   // preliminaries
@@ -576,56 +2333,28 @@ arma::field<arma::mat> FSimMF(    arma::mat B,     // companion form of transiti
   uword p  = sA/m; //number of lags
   uword k  = H.n_rows; //number of observables
   
-  // For frequencies that do not change rows of HJ will be fixed.
-  sp_mat HJ(k,sA);
-  mat    hj;
-  for(uword j = 0; j<k; j++){
-    hj  = H(j,span::all)*J_MF(freq(j), m, LD(j), sA);
-    HJ  = sprow(HJ,hj,j); //replace row j of HJ with vector hj
-  }
+  sp_mat HJ = mf_HJ(H, mf_cache(freq, LD, m, sA));
   
   //Draw Eps (for observations) and E (for factors)
   vec mu_Eps(k,fill::zeros);
   vec mu_E(m,fill::zeros);
-  mat Eps = trans(mvrnrm(T,mu_Eps,R));
-  mat E   = trans(mvrnrm(T,mu_E,q));
-  mat Eburn = trans(mvrnrm(100,mu_E,q));
+  mat Eps = trans(mvrnrm(T,mu_Eps,R,rng));
+  mat E   = trans(mvrnrm(T,mu_E,q,rng));
   
-  mat Q  = kron(eye<mat>(p,p), q);
+  //Initial factors are drawn from their unconditional distribution
+  mat Q(sA,sA,fill::zeros);
+  Q(span(0,m-1),span(0,m-1)) = q;
+  mat Pi  = Lyapunov(comp_form(B*Jb), Q);
+  vec z0  = mvrnrm(1, zeros<vec>(sA), Pi, rng);
   
   //Declairing variables for the forward recursion
-  mat Z(T+1,sA, fill::zeros), Yd(T,k);
-  vec z0(sA, fill::zeros);
-  sp_mat Hn, Mn;
-  vec x, yt, yd(k), eps;
-  uvec ind;
-  
-  //Forward Recursion Burn In
-  if(p>1){
-    for(uword t=0; t<100; t++) {
-      //next period factors
-      x      = B*Jb*z0 + trans(Eburn.row(t)); //prediction for Z(t+1)
-      z0(span(m,sA-1)) = z0.subvec(0,sA-m-1);
-      z0(span(0,m-1)) = x;
-    }
-  }else{
-    for(uword t=0; t<100; t++) {
-      //next period factors
-      z0      = B*Jb*z0 + trans(Eburn.row(t)); //prediction for Z(t+1)
-    }
-  }
+  mat Z(T+1,sA, fill::zeros);
+  vec x;
   
   Z.row(0) = trans(z0);
   
   //Forward Recursion
   for(uword t=0; t<T; t++) {
-    yt        = trans(Y.row(t));
-    ind       = find_finite(yt); //identify missing values that they are replicated in simulated data
-    Hn        = sp_rows(HJ,ind);
-    yd.fill(datum::nan);
-    eps       = trans(Eps.row(t));
-    yd(ind)   = Hn*trans(Z.row(t)) + eps(ind);
-    Yd.row(t) = trans(yd);
     //next period factors
     x      = B*Jb*trans(Z.row(t)) + trans(E.row(t)); //prediction for Z(t+1)
     Z(t+1,span(0,m-1))  = trans(x);
@@ -635,6 +2364,10 @@ arma::field<arma::mat> FSimMF(    arma::mat B,     // companion form of transiti
   }
   Z.shed_row(T); //we don't use predictions for period T (zero indexed)
   
+  //Simulated observations, replicating missing values in Y
+  mat Yd = Z*trans(HJ) + Eps;
+  Yd.elem(pat.miss).fill(datum::nan);
+  
   
   field<mat> Out(3);
   Out(0)   = Z;
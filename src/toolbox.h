@@ -2,22 +2,141 @@
 #define TOOLBOX_H
 
 #include <RcppArmadillo.h>
-//#include "utils.h"
+#include "utils.h"
+#include "filter.h"
 using namespace arma;
 using namespace Rcpp;
 
+arma::vec mf_weights(arma::uword days, arma::uword ld);
 arma::sp_mat J_MF(arma::uword days, arma::uword m, arma::uword ld, arma::uword sA);
-List PrinComp(arma::mat Y, arma::uword m);
+MFCache mf_cache(const arma::uvec& freq, const arma::uvec& LD, arma::uword m, arma::uword sA);
+arma::mat mf_ZJt(const arma::mat& Z, arma::uword t0, arma::uword T, const MFAgg& a);
+arma::rowvec mf_hJ(const arma::rowvec& h, const MFAgg& a);
+arma::sp_mat mf_HJ(const arma::mat& H, const MFCache& mf);
+void mf_HJ(arma::sp_mat& HJ, const arma::mat& H, const MFCache& mf);
+void state_cov(arma::sp_mat& Q, const arma::mat& q, arma::uword sA);
+void eig_top(arma::vec& eigval, arma::mat& eigvec, const arma::mat& S, arma::uword m,
+             double tol = 1e-10, arma::uword max_iter = 300);
+List PrinComp(arma::mat Y, arma::uword m, bool truncated = false);
 List BReg(arma::mat X, arma::mat Y, bool Int, arma::mat Bp, double lam, double nu,
           arma::uword reps = 1000, arma::uword burn = 1000);
 List BReg_diag(arma::mat X,  arma::mat Y, bool Int, arma::mat Bp, double lam, arma::vec nu,
                arma::uword reps = 1000, arma::uword burn = 1000); 
+ObsPatterns obs_patterns(const arma::mat& Y);
+ObsMats obs_mats(const ObsPatterns& pat, const arma::sp_mat& HJ, const arma::mat& R,
+                 bool univariate, bool collapse);
+void obs_mats(ObsMats& om, const ObsPatterns& pat, const arma::sp_mat& HJ, const arma::mat& R,
+              bool univariate, bool collapse);
+Companion companion(const arma::mat& Bc);
+Companion find_companion(const arma::sp_mat& A);
+arma::vec comp_Az(const Companion& A, const arma::vec& z);
+void comp_Az(arma::vec& Az, const Companion& A, const arma::vec& z);
+arma::rowvec comp_rA(const Companion& A, const arma::rowvec& r);
+void comp_rA(arma::rowvec& rA, const Companion& A, const arma::mat& X, arma::uword t);
+arma::mat comp_AX(const Companion& A, const arma::mat& X);
+arma::mat comp_APA(const Companion& A, const arma::mat& P, const arma::sp_mat& Q);
+void comp_APA(arma::mat& APA, arma::mat& BP, const Companion& A, const arma::mat& P,
+              const arma::sp_mat& Q);
+arma::mat comp_AtXA(const Companion& A, const arma::mat& X);
+void UVgain(arma::mat& P, arma::mat& K, arma::mat& Fi, double& ld, const arma::mat& Hn,
+            const arma::vec& Rn, arma::vec& PH);
+void UVgain(arma::mat& P, arma::mat& K, arma::mat& Fi, double& ld, const arma::mat& Hn,
+            const arma::vec& Rn);
+double UVfilter(arma::vec& Z, arma::vec& PE, const arma::mat& K, const arma::mat& Fi,
+                const arma::mat& Hn, const arma::vec& Yn);
+double UVupdate(arma::vec& Z, arma::mat& P, arma::mat& K, arma::vec& PE, arma::vec& Fi,
+                const arma::mat& Hn, const arma::vec& Rn, const arma::vec& Yn);
+void UVsmooth(arma::rowvec& r, const arma::mat& K, const arma::vec& PE, const arma::mat& Fi,
+              const arma::mat& Hn);
+void CLgain(arma::mat& P, arma::mat& Gi, double& ld, const arma::mat& W, arma::mat& C, arma::mat& M);
+void CLgain(arma::mat& P, arma::mat& Gi, double& ld, const arma::mat& W);
+double CLfilter(arma::vec& Z, arma::vec& u, const arma::mat& P0, const arma::mat& Gi, double ld,
+                const arma::mat& W, const arma::vec& b, double yRy, double ldR, arma::vec& e,
+                arma::vec& Pe);
+double CLupdate(arma::vec& Z, arma::mat& P, arma::vec& u, arma::mat& PW, const arma::mat& W,
+                const arma::vec& b, double yRy, double ldR);
+void MVgain(arma::mat& P, arma::mat& K, arma::mat& Si, double& ld, const arma::mat& Hn,
+            const arma::mat& Rn, arma::mat& PH, arma::mat& S, arma::mat& C);
+void kf_work(KFWork& w, arma::uword sA, arma::uword k);
+arma::uword pattern_cycle(const ObsPatterns& pat, arma::uword t);
+void KFilter(FilterOut& kf, KFWork& w, const Companion& A, const arma::sp_mat& Q, const arma::vec& Zi,
+             const arma::mat& Pi, const arma::mat& Y, const ObsPatterns& pat, const ObsMats& om,
+             bool univariate, bool collapse);
+void KFilter(FilterOut& kf, const Companion& A, const arma::sp_mat& Q, const arma::mat& Pi,
+             const arma::mat& Y, const ObsPatterns& pat, const ObsMats& om,
+             bool univariate, bool collapse);
+void KFilter(FilterOut& kf, const Companion& A, const arma::sp_mat& Q, const arma::vec& Zi,
+             const arma::mat& Pi, const arma::mat& Y, const ObsPatterns& pat, const ObsMats& om,
+             bool univariate, bool collapse);
+double KFmean(arma::vec& Z, arma::vec& PE, const arma::mat& K, const arma::mat& Si, double ld,
+              const ObsMats& om, arma::uword j, const arma::vec& Yn, bool univariate, bool collapse,
+              KFWork& w);
+double KFmean(arma::vec& Z, arma::vec& PE, const FilterOut& kf, arma::uword s, const ObsMats& om,
+              arma::uword j, const arma::vec& Yn, bool univariate, bool collapse, KFWork& w);
+void kf_gain(arma::mat& P, arma::mat& K, arma::mat& Si, double& ld, const ObsMats& om, arma::uword j,
+             bool univariate, bool collapse, KFWork& w);
+double kf_step(arma::vec& Z, arma::mat& P, arma::vec& PE, arma::mat& K, arma::mat& Si, double& ld,
+               bool fixed, const Companion& A, const arma::sp_mat& Q, const arma::vec& Yn,
+               const ObsMats& om, arma::uword j, bool univariate, bool collapse, KFWork& w);
+double KFmean(arma::vec& Z, arma::vec& PE, const FilterOut& kf, arma::uword s, const ObsMats& om,
+              arma::uword j, const arma::vec& Yn, bool univariate, bool collapse);
+void KFmeans(FilterOut& kf, const Companion& A, const arma::vec& Zi, const arma::mat& Y,
+             const ObsPatterns& pat, const ObsMats& om, bool univariate, bool collapse);
+FilterOut KFilter(const Companion& A, const arma::sp_mat& Q, const arma::mat& Pi,
+                  const arma::mat& Y, const ObsPatterns& pat, const ObsMats& om,
+                  bool univariate, bool collapse);
+void DSback(arma::mat& r, KFWork& w, const FilterOut& kf, const Companion& A,
+            const ObsPatterns& pat, const ObsMats& om, bool univariate, bool collapse);
+void DSback(arma::mat& r, const FilterOut& kf, const Companion& A, const ObsPatterns& pat,
+            const ObsMats& om, bool univariate, bool collapse);
+arma::mat DSback(const FilterOut& kf, const Companion& A, const ObsPatterns& pat,
+                 const ObsMats& om, bool univariate, bool collapse);
+void EMsmooth(EMStats& st, const Companion& A, const arma::sp_mat& Q, const arma::mat& Pi,
+              const arma::mat& Y, const ObsPatterns& pat, const ObsMats& om, arma::uword m);
 List DSmooth(arma::mat B,  arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y,     
-             arma::uvec freq, arma::uvec LD);
+             arma::uvec freq, arma::uvec LD, bool univariate = false, bool collapse = false,
+             int keep = -1, bool store_gains = false);
+List DSmooth(const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q, const arma::mat& H,
+             const arma::mat& R, const arma::mat& Y, const arma::uvec& freq, const arma::uvec& LD,
+             bool univariate, bool collapse, int keep, bool store_gains, const ObsPatterns& pat);
+void start_state(arma::vec& Z, arma::mat& P, const Companion& A, const arma::sp_mat& Q);
+double advance_state(arma::vec& Z, arma::mat& P, const Companion& A, const arma::sp_mat& Q,
+                     const arma::mat& Y, const ObsPatterns& pat, const ObsMats& om, bool collapse);
+List FilterState(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y,
+                 arma::uvec freq, arma::uvec LD, arma::vec Zi, arma::mat Pi);
+List DSupdate(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y,
+              arma::uvec freq, arma::uvec LD, arma::vec Zi, arma::mat Pi, arma::uword n_safe = 0,
+              bool univariate = false, bool collapse = false);
+arma::mat DSstates(const FilterOut& kf, const Companion& A, const arma::sp_mat& Q, const arma::vec& Zi,
+                   const arma::mat& Pi, const ObsPatterns& pat, const ObsMats& om, bool univariate,
+                   bool collapse);
+arma::mat news_by_series(FilterOut& kf, const Companion& A, const arma::sp_mat& Q, const arma::mat& Pi,
+                         const arma::mat& D, const arma::rowvec& hj, const ObsPatterns& pat,
+                         const ObsMats& om, bool univariate, bool collapse);
+List DSnews(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y_old,
+            arma::mat Y_new, arma::uvec freq, arma::uvec LD, arma::uword target, arma::uword n_back = 0,
+            bool univariate = false, bool collapse = false,
+            Rcpp::Nullable<Rcpp::List> state = R_NilValue);
 arma::mat DSMF( arma::mat B,  arma::sp_mat Jb, arma::mat q,  arma::mat H,  arma::mat R,  arma::mat Y,
-                arma::uvec freq, arma::uvec LD);
+                arma::uvec freq, arma::uvec LD, bool univariate = false, bool collapse = false);
+arma::mat DSMF( const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q, const arma::mat& H,
+                const arma::mat& R, const arma::mat& Y, const arma::uvec& freq, const arma::uvec& LD,
+                bool univariate, bool collapse, const ObsPatterns& pat);
+arma::mat SimSmooth(arma::mat B, arma::sp_mat Jb, arma::mat q, arma::mat H, arma::mat R, arma::mat Y,
+                    arma::uvec freq, arma::uvec LD, bool univariate = false, bool collapse = false);
+arma::mat SimSmooth(const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q, const arma::mat& H,
+                    const arma::mat& R, const arma::mat& Y, const arma::uvec& freq, const arma::uvec& LD,
+                    bool univariate, bool collapse, const ObsPatterns& pat, rng_stream& rng);
+void SimSmooth(DrawWork& ws, const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q,
+               const arma::mat& H, const arma::mat& R, const arma::mat& Y, const arma::uvec& freq,
+               const arma::uvec& LD, bool univariate, bool collapse, const ObsPatterns& pat,
+               rng_stream& rng);
 arma::field<arma::mat> FSimMF(arma::mat B, arma::sp_mat Jb,  arma::mat q,  arma::mat H,  
                               arma::mat R,  arma::mat Y,  arma::uvec freq, arma::uvec LD);
+arma::field<arma::mat> FSimMF(const arma::mat& B, const arma::sp_mat& Jb, const arma::mat& q,
+                              const arma::mat& H, const arma::mat& R, const arma::mat& Y,
+                              const arma::uvec& freq, const arma::uvec& LD,
+                              const ObsPatterns& pat, rng_stream& rng);
 arma::field<arma::mat> Identify(arma::mat H, arma::mat q);
 
 
@@ -1,9 +1,18 @@
 // [[Rcpp::depends(RcppArmadillo)]]
 
+#include "alloc_count.h"
 #include <RcppArmadillo.h>
+#include <random>
+#include <vector>
+#include "quantile.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 using namespace arma;
 using namespace Rcpp;
 
+typedef std::mt19937_64 rng_stream; //as in utils.h
+
 //Quick regression omitting missing values
 // [[Rcpp::export]]
 arma::mat QuickReg(arma::mat X,
@@ -163,20 +172,18 @@ arma::sp_mat sp_cols(arma::sp_mat A,
 
 
 //Replace row r of sparse matrix A with the (sparse) vector a.
-//Should be reasonably fast with Armadillo 8 or newer
+//Assigning elements of a sparse matrix one at a time can repack the whole matrix for each
+//element, so the row is cleared and the non-zero elements of a are added in one pass.
 arma::sp_mat sprow(arma::sp_mat A,
                    arma::mat a,
                    arma::uword r   ){
-  //This intitally used find(a) to inentify non-zero elements of a, but that
-  //did not replace elements that are non-zero in A and zero in a
-  uword n_cols     = A.n_cols;
-  if(n_cols>a.n_elem){
-    a = join_horiz(a, zeros<mat>(1,n_cols-a.n_elem));
-  }
-  for(uword n      = 0; n < n_cols; n++){
-    A(r,n)         = a(n);
-  }
-  return(A);
+  uvec nz  = find(a);
+  umat loc(2, nz.n_elem);
+  loc.row(0).fill(r);
+  loc.row(1) = trans(nz);
+  sp_mat Ar(loc, vec(a(nz)), A.n_rows, A.n_cols);
+  A.row(r).zeros();
+  return(A + Ar);
 }
 
 //Create the companion form of the transition matrix B
@@ -188,6 +195,132 @@ arma::mat comp_form(arma::mat B){
   return(A);
 }
 
+//Whether the VAR with coefficients B = [B_1 ... B_p] is stationary, i.e. the spectral radius of its
+//companion matrix is below 1. Cheap tests settle most draws: a sum of lag norms below 1 is
+//sufficient; det(I - A) = det(I - sum B_i) <= 0 or det(I + A) = det(I - sum (-1)^i B_i) <= 0 means
+//a real eigenvalue at or beyond +-1; with one factor the Schur-Cohn recursion is exact. Otherwise the
+//eigenvalues of the companion matrix decide, and n_eigen is incremented.
+bool stationary(const arma::mat& B,
+                arma::uword& n_eigen){
+  uword m = B.n_rows;
+  uword p = B.n_cols/m;
+  double n_inf = 0, n_one = 0;
+  mat S1(m,m,fill::zeros), S2(m,m,fill::zeros);
+  for(uword i = 0; i < p; i++){
+    const mat Bi = B.cols(i*m, (i+1)*m-1);
+    n_inf += norm(Bi, "inf");
+    n_one += norm(Bi, 1);
+    S1    += Bi;
+    if(i % 2 == 0){ //(-1)^(i+1) for lag i+1
+      S2  -= Bi;
+    } else{
+      S2  += Bi;
+    }
+  }
+  if(n_inf < 1 || n_one < 1){
+    return(true);
+  }
+  if(det(eye<mat>(m,m) - S1) <= 0 || det(eye<mat>(m,m) - S2) <= 0){
+    return(false);
+  }
+  if(m == 1){
+    //Schur-Cohn: step down z^p + a_1 z^(p-1) + ... + a_p, a_i = -b_i, checking reflection coefficients
+    vec a = -trans(B.row(0)), b;
+    double k;
+    for(uword n = p; n > 0; n--){
+      k = a(n-1);
+      if(std::abs(k) >= 1){
+        return(false);
+      }
+      b.set_size(n-1);
+      for(uword i = 0; i+1 < n; i++){
+        b(i) = (a(i) - k*a(n-2-i))/(1 - k*k);
+      }
+      a = b;
+    }
+    return(true);
+  }
+  n_eigen++;
+  cx_vec eigval = eig_gen(comp_form(B));
+  return(max(abs(eigval)) < 1);
+}
+
+//Whether the VAR with coefficients B = [B_1 ... B_p] is stationary
+// [[Rcpp::export]]
+bool is_stationary(arma::mat B){
+  uword n_eigen = 0;
+  return(stationary(B, n_eigen));
+}
+
+//X = (X + X')/2 in place, without the temporaries of symmatu((X+trans(X))/2)
+void sym_avg(arma::mat& X){
+  for(uword c = 0; c < X.n_cols; c++){
+    for(uword r = 0; r < c; r++){
+      double v = (X(r,c) + X(c,r))/2;
+      X(r,c)   = v;
+      X(c,r)   = v;
+    }
+  }
+}
+
+//Largest absolute row sum of X - s*Y (s = 0 for the norm of X), without forming X - s*Y
+double norm_inf(const arma::mat& X,
+                const arma::mat& Y,
+                double s){
+  double nrm = 0, rs;
+  for(uword r = 0; r < X.n_rows; r++){
+    rs = 0;
+    for(uword c = 0; c < X.n_cols; c++){
+      rs += std::abs(X(r,c) - (s == 0 ? 0 : s*Y(r,c)));
+    }
+    nrm = std::max(nrm, rs);
+  }
+  return(nrm);
+}
+
+//Unconditional variance of a stationary state, i.e. the solution P of P = A*P*A' + Q. Uses the
+//doubling algorithm: after k steps P is the sum of the first 2^k terms of A^j*Q*A^j', so only a few
+//sA x sA products are needed rather than a solve with the sA^2 x sA^2 matrix I - kron(A,A).
+//
+//The products are dense even when A is in companion form. Squaring A fills in m more rows of the
+//power each step, so A^(2^k) keeps no companion structure after the first step or two. The
+//alternatives that do keep it cost more here: the fixed point iteration P = A*P*A' + Q with the
+//companion kernels needs O(1/(1-rho^2)) steps for spectral radius rho, against O(log(1/(1-rho)))
+//for doubling, and solving for the autocovariances in the top m x sA block of P is a linear system
+//in about m^2*p unknowns. Doubling is O(sA^3) per step with a few dozen steps at most.
+void Lyapunov(arma::mat& P,
+              arma::mat& Ak,
+              arma::mat& W,
+              const arma::mat& A,
+              const arma::mat& Q){
+  P  = Q;
+  Ak = A;
+  for(uword it = 0; it < 64; it++){
+    W  = Ak*P;
+    P += W*trans(Ak);
+    W  = Ak*Ak;
+    Ak = W; //A^(2^(it+1)), copied rather than swapped so each buffer keeps its memory
+    if(!Ak.is_finite()){
+      break;
+    }
+    if(norm_inf(Ak, Ak, 0) < 1e-10){ //remaining terms are negligible
+      sym_avg(P);
+      return;
+    }
+  }
+  throw std::runtime_error("Transition matrix is not stationary, so the state has no unconditional variance");
+}
+
+//Allocating version. The in place one above is for repeated calls with models of the same size:
+//P is the solution and Ak, W are work, all reusing their memory.
+// [[Rcpp::export]]
+arma::mat Lyapunov(const arma::mat& A,
+                   const arma::mat& Q){
+  mat P, Ak, W;
+  Lyapunov(P, Ak, W, A, Q);
+  return(P);
+}
+
 //mvrnrm and rinvwish by Francis DiTraglia
 
 // [[Rcpp::export]]
@@ -205,11 +338,52 @@ arma::mat mvrnrm(int n, arma::vec mu, arma::mat Sigma){
   vec eigval;
   mat eigvec;
   eig_sym(eigval, eigvec, Sigma);
-  X = eigvec * diagmat(sqrt(eigval)) * X;
+  X = eigvec * diagmat(sqrt(clamp(eigval, 0, datum::inf))) * X; //Sigma may be only semi-definite
+  X.each_col() += mu;
+  return(X);
+}
+
+//------------------------------------------------------------
+// Normal draws given Cholesky factors. Regressions factor the posterior precision X'X + Lam once,
+// then means and draws cost triangular solves rather than an inverse and an eigen decomposition.
+//------------------------------------------------------------
+
+//inv(P)*b given the upper Cholesky factor U of P = U'U
+arma::mat chol_solve(const arma::mat& U,
+                     const arma::mat& b){
+  return(solve(trimatu(U), solve(trimatl(trans(U)), b)));
+}
+
+//mu + sqrt(s)*inv(U)*Z, i.e. draws from N(mu, s*inv(U'U)) given standard normal columns Z
+static arma::mat chol_shift(const arma::vec& mu, const arma::mat& U, double s, const arma::mat& Z){
+  mat X = sqrt(s)*solve(trimatu(U), Z);
   X.each_col() += mu;
   return(X);
 }
 
+//n draws from N(mu, s*inv(P)) given the upper Cholesky factor U of the precision P
+// [[Rcpp::export]]
+arma::mat mvrnrm_chol(int n,
+                      const arma::vec& mu,
+                      const arma::mat& U,
+                      double s = 1){
+  RNGScope scope;
+  mat Z = reshape(vec(rnorm(U.n_cols * n)), U.n_cols, n);
+  return(chol_shift(mu, U, s, Z));
+}
+
+//Matrix normal draw M + L*Z*inv(U)', so that vec of the draw is N(vec(M), inv(U'U) kron L*L').
+//For VAR coefficients with covariance kron(v, q) this needs Cholesky factors of the two small
+//matrices rather than an eigen decomposition of their Kronecker product.
+// [[Rcpp::export]]
+arma::mat mnrnrm_chol(const arma::mat& M,
+                      const arma::mat& U,
+                      const arma::mat& L){
+  RNGScope scope;
+  mat Z = reshape(vec(rnorm(M.n_elem)), M.n_rows, M.n_cols);
+  return(M + trans(solve(trimatu(U), trans(L*Z))));
+}
+
 /*-------------------------------------------------------
 # Generate Draws from an Inverse Wishart Distribution
 # via the Bartlett Decomposition
@@ -257,6 +431,140 @@ double invchisq(double nu, double scale){
   return(s);
 }
 
+//------------------------------------------------------------
+// Samplers drawing from a local stream rather than R's RNG.
+// These may be called from inside OpenMP parallel regions.
+//------------------------------------------------------------
+
+//Seed for a local stream taken from R's RNG so that set.seed() still governs results
+arma::uword rng_seed(){
+  RNGScope scope;
+  double s = std::floor(R::unif_rand()*4294967295.0);
+  return((uword) s);
+}
+
+//Matrix of standard normal draws
+arma::mat randn_stream(arma::uword n_rows,
+                       arma::uword n_cols,
+                       rng_stream& rng){
+  std::normal_distribution<double> N(0.0, 1.0);
+  mat X(n_rows, n_cols);
+  for(uword j = 0; j < X.n_elem; j++){
+    X(j) = N(rng);
+  }
+  return(X);
+}
+
+//Fill X with standard normal draws, reusing its memory
+void randn_stream(arma::mat& X,
+                  rng_stream& rng){
+  std::normal_distribution<double> N(0.0, 1.0);
+  for(uword j = 0; j < X.n_elem; j++){
+    X(j) = N(rng);
+  }
+}
+
+//C such that C*C' = Sigma, from the eigen decomposition as Sigma may be only semi-definite. C is
+//written in place and eigval is work. Diagonal Sigma (e.g. R in DrawFactors) needs no decomposition.
+void sqrt_psd(arma::mat& C,
+              arma::vec& eigval,
+              const arma::mat& Sigma){
+  if(Sigma.is_diagmat()){
+    C.zeros(Sigma.n_rows, Sigma.n_cols);
+    for(uword j = 0; j < C.n_cols; j++){
+      C(j,j) = std::sqrt(std::max(Sigma(j,j), 0.0));
+    }
+    return;
+  }
+  eig_sym(eigval, C, Sigma);
+  for(uword j = 0; j < C.n_cols; j++){
+    C.col(j) *= std::sqrt(std::max(eigval(j), 0.0));
+  }
+}
+
+arma::mat sqrt_psd(const arma::mat& Sigma){
+  vec eigval;
+  mat eigvec;
+  sqrt_psd(eigvec, eigval, Sigma);
+  return(eigvec);
+}
+
+arma::mat mvrnrm(int n, arma::vec mu, arma::mat Sigma, rng_stream& rng){
+  int p = Sigma.n_cols;
+  mat X = randn_stream(p, n, rng);
+  X = sqrt_psd(Sigma) * X;
+  X.each_col() += mu;
+  return(X);
+}
+
+arma::mat mvrnrm_chol(int n, const arma::vec& mu, const arma::mat& U, double s, rng_stream& rng){
+  return(chol_shift(mu, U, s, randn_stream(U.n_cols, n, rng)));
+}
+
+arma::mat mnrnrm_chol(const arma::mat& M, const arma::mat& U, const arma::mat& L, rng_stream& rng){
+  mat Z = randn_stream(M.n_rows, M.n_cols, rng);
+  return(M + trans(solve(trimatu(U), trans(L*Z))));
+}
+
+arma::cube rinvwish(int n, int v, arma::mat S, rng_stream& rng){
+  std::normal_distribution<double> N(0.0, 1.0);
+  int p = S.n_rows;
+  mat L = chol(inv_sympd(S), "lower");
+  cube sims(p, p, n, fill::zeros);
+  for(int j = 0; j < n; j++){
+    mat A(p,p, fill::zeros);
+    for(int i = 0; i < p; i++){
+      std::chi_squared_distribution<double> chisq(v - i); //zero-indexing
+      A(i,i) = sqrt(chisq(rng));
+    }
+    for(int row = 1; row < p; row++){
+      for(int col = 0; col < row; col++){
+        A(row, col) = N(rng);
+      }
+    }
+    mat LA_inv = inv(trimatl(trimatl(L) * trimatl(A)));
+    sims.slice(j) = LA_inv.t() * LA_inv;
+  }
+  return(sims);
+}
+
+//Scaled inverse chi squared. As in invchisq() above, non-integer nu is truncated.
+double invchisq(double nu, double scale, rng_stream& rng){
+  std::chi_squared_distribution<double> chisq(std::floor(nu));
+  return(scale/chisq(rng));
+}
+
+//Check for a user interrupt without throwing, so it is safe to poll inside a parallel region.
+static void chk_int(void* dummy){
+  R_CheckUserInterrupt();
+}
+
+bool check_interrupt(){
+  return(R_ToplevelExec(chk_int, NULL) == FALSE);
+}
+
+//Only the master thread may touch the R API (console output, interrupts)
+bool master_thread(){
+#ifdef _OPENMP
+  return(omp_get_thread_num() == 0);
+#else
+  return(true);
+#endif
+}
+
+//Set the number of threads for later parallel regions and return the previous number. Without
+//OpenMP there is always one thread.
+// [[Rcpp::export]]
+int omp_threads(int n){
+#ifdef _OPENMP
+  int n0 = omp_get_max_threads();
+  omp_set_num_threads(n);
+  return(n0);
+#else
+  return(1);
+#endif
+}
+
 //Stack times series data in VAR format
 // [[Rcpp::export]]
 arma:: mat stack_obs(arma::mat nn, arma::uword p, arma::uword r = 0){
@@ -276,3 +584,226 @@ arma:: mat stack_obs(arma::mat nn, arma::uword p, arma::uword r = 0){
   }
   return(N);
 }
+
+
+//------------------------------------------------------------
+// Streaming quantiles (P^2 algorithm, Jain and Chlamtac 1985)
+//------------------------------------------------------------
+
+//Sketch of the p quantile of n elements
+P2Quantile p2_init(arma::uword n, double p){
+  P2Quantile s;
+  s.p     = p;
+  s.count = 0;
+  s.q.zeros(5,n);
+  s.pos   = repmat(linspace<vec>(1,5,5), 1, n);
+  s.des   = {1, 1+2*p, 1+4*p, 3+2*p, 5};
+  s.inc   = {0, p/2, p, (1+p)/2, 1};
+  return(s);
+}
+
+//Add one draw of each element
+void p2_add(P2Quantile& s, const arma::vec& x){
+  uword n = s.q.n_cols;
+  //the first five draws are the markers
+  if(s.count < 5){
+    s.q.row(s.count) = trans(x);
+    s.count++;
+    if(s.count == 5){
+      for(uword j = 0; j < n; j++){
+        s.q.col(j) = sort(s.q.col(j));
+      }
+    }
+    return;
+  }
+  s.count++;
+  s.des += s.inc;
+  uword c, nb;
+  double d, ds, qp;
+  for(uword j = 0; j < n; j++){
+    double* q   = s.q.colptr(j);
+    double* pos = s.pos.colptr(j);
+    //cell of the new draw, extending the extreme markers if needed
+    if(x(j) < q[0]){
+      q[0] = x(j);
+      c    = 0;
+    } else if(x(j) >= q[4]){
+      q[4] = x(j);
+      c    = 3;
+    } else{
+      c = 0;
+      while(x(j) >= q[c+1]) c++;
+    }
+    for(uword i = c+1; i < 5; i++){
+      pos[i] += 1;
+    }
+    //move the middle markers towards their desired positions
+    for(uword i = 1; i < 4; i++){
+      d = s.des(i) - pos[i];
+      if((d >= 1 && pos[i+1]-pos[i] > 1) || (d <= -1 && pos[i-1]-pos[i] < -1)){
+        ds = (d > 0) ? 1 : -1;
+        nb = (d > 0) ? i+1 : i-1;
+        qp = q[i] + ds/(pos[i+1]-pos[i-1])*((pos[i]-pos[i-1]+ds)*(q[i+1]-q[i])/(pos[i+1]-pos[i]) +
+                                          (pos[i+1]-pos[i]-ds)*(q[i]-q[i-1])/(pos[i]-pos[i-1]));
+        if(q[i-1] < qp && qp < q[i+1]){
+          q[i] = qp; //parabolic prediction
+        } else{
+          q[i] = q[i] + ds*(q[nb]-q[i])/(pos[nb]-pos[i]); //linear prediction
+        }
+        pos[i] += ds;
+      }
+    }
+  }
+}
+
+//Current estimate of the quantile of each element
+arma::vec p2_get(const P2Quantile& s){
+  uword n = s.q.n_cols;
+  if(s.count >= 5){
+    return(trans(s.q.row(2)));
+  }
+  //with fewer than five draws use the draws themselves
+  vec out(n);
+  out.fill(datum::nan);
+  if(s.count > 0){
+    uword idx = (uword) std::floor(s.p*(s.count-1) + 0.5);
+    for(uword j = 0; j < n; j++){
+      vec v  = sort(s.q(span(0,s.count-1),span(j,j)));
+      out(j) = v(idx);
+    }
+  }
+  return(out);
+}
+
+//Estimate of the quantile of the pooled draws of several sketches (e.g. one per chain). The markers
+//of each sketch give the number of its draws below x by linear interpolation of their positions on
+//their heights. These counts are summed over sketches, and the quantile is the x at which the sum
+//reaches rank 1+p*(N-1) of the N pooled draws, interpolating between marker heights.
+arma::vec p2_merge(const std::vector<P2Quantile>& s){
+  if(s.size() == 1){
+    return(p2_get(s[0]));
+  }
+  uword n  = s[0].q.n_cols;
+  uword ns = s.size();
+  double p = s[0].p;
+  uword N  = 0;
+  for(uword c = 0; c < ns; c++){
+    N += s[c].count;
+  }
+  vec out(n);
+  out.fill(datum::nan);
+  if(N == 0){
+    return(out);
+  }
+  double target = 1 + p*(N-1);
+  //markers (heights and 1 indexed positions) of each sketch for one element; with fewer than five
+  //draws these are the draws themselves
+  std::vector<vec> h(ns), ps(ns);
+  vec x, rank;
+  for(uword j = 0; j < n; j++){
+    x.reset();
+    for(uword c = 0; c < ns; c++){
+      if(s[c].count >= 5){
+        h[c]  = s[c].q.col(j);
+        ps[c] = s[c].pos.col(j);
+      } else if(s[c].count > 0){
+        h[c]  = sort(s[c].q(span(0,s[c].count-1),span(j,j)));
+        ps[c] = linspace<vec>(1, s[c].count, s[c].count);
+      } else{
+        h[c].reset();
+        ps[c].reset();
+      }
+      x = join_cols(x, h[c]);
+    }
+    x = sort(x);
+    //pooled rank at each marker height
+    rank.zeros(x.n_elem);
+    for(uword i = 0; i < x.n_elem; i++){
+      for(uword c = 0; c < ns; c++){
+        uword nc = h[c].n_elem;
+        if(nc == 0 || x(i) < h[c](0)){
+          continue;
+        }
+        if(x(i) >= h[c](nc-1)){
+          rank(i) += ps[c](nc-1);
+          continue;
+        }
+        uword a = 0;
+        while(x(i) >= h[c](a+1)) a++;
+        rank(i) += ps[c](a) + (x(i)-h[c](a))/(h[c](a+1)-h[c](a))*(ps[c](a+1)-ps[c](a));
+      }
+    }
+    uword i = 0;
+    while(i+1 < x.n_elem && rank(i) < target) i++;
+    if(i == 0 || rank(i) <= rank(i-1)){
+      out(j) = x(i);
+    } else{
+      out(j) = x(i-1) + (target-rank(i-1))/(rank(i)-rank(i-1))*(x(i)-x(i-1));
+    }
+  }
+  return(out);
+}
+
+//Streaming estimate of the p quantile of each row of X, adding the columns one at a time. With
+//sketches > 1 the columns are split in turn between that many sketches, which are then merged as
+//for chains in EstDFM.
+// [[Rcpp::export]]
+arma::vec p2_quantile(arma::mat X,
+                      double p,
+                      arma::uword sketches = 1){
+  std::vector<P2Quantile> s(std::max<uword>(sketches,1), p2_init(X.n_rows, p));
+  for(uword j = 0; j < X.n_cols; j++){
+    p2_add(s[j % s.size()], X.col(j));
+  }
+  return(p2_merge(s));
+}
+
+//------------------------------------------------------------
+// Allocation counting for tests (alloc_count.h)
+//------------------------------------------------------------
+
+#ifdef BDFM_ALLOC_COUNT
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<bool> alloc_counting(false);
+static std::atomic<std::size_t> alloc_calls(0);
+
+void* alloc_count_acquire(std::size_t n){
+  if(alloc_counting) alloc_calls++;
+  return std::malloc(n);
+}
+
+void alloc_count_release(void* p){
+  std::free(p);
+}
+
+void alloc_count_start(){
+  alloc_calls    = 0;
+  alloc_counting = true;
+}
+
+std::size_t alloc_count_stop(){
+  alloc_counting = false;
+  return alloc_calls;
+}
+
+//new[] and delete[] call these by default, so std containers and arma::field are counted too
+void* operator new(std::size_t n){
+  if(alloc_counting) alloc_calls++;
+  void* p = std::malloc(n > 0 ? n : 1);
+  if(p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept{
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept{
+  std::free(p);
+}
+
+#endif
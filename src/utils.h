@@ -2,8 +2,15 @@
 #define UTILS_H
 
 #include <RcppArmadillo.h>
+#include <random>
+#include <vector>
+#include "quantile.h"
 using namespace arma;
 using namespace Rcpp;
+
+// R's RNG is not thread safe, so code that draws in parallel carries its own stream
+typedef std::mt19937_64 rng_stream;
+
 arma::mat QuickReg(arma::mat X, arma::mat Y);
 List UVreg(arma::vec x, arma::vec y, arma::uword rm_outlier = 0);
 arma::sp_mat MakeSparse(arma::mat A);
@@ -11,9 +18,35 @@ arma::sp_mat sp_rows(arma::sp_mat A, arma::uvec r);
 arma::sp_mat sp_cols(arma::sp_mat A, arma::uvec r);
 arma::sp_mat sprow(arma::sp_mat A, arma::mat a, arma::uword r);
 arma::mat comp_form(arma::mat B);
+bool stationary(const arma::mat& B, arma::uword& n_eigen);
+bool is_stationary(arma::mat B);
+void sym_avg(arma::mat& X);
+double norm_inf(const arma::mat& X, const arma::mat& Y, double s);
+arma::mat Lyapunov(const arma::mat& A, const arma::mat& Q);
+void Lyapunov(arma::mat& P, arma::mat& Ak, arma::mat& W, const arma::mat& A, const arma::mat& Q);
 arma::mat mvrnrm(int n, arma::vec mu, arma::mat Sigma);
+arma::mat chol_solve(const arma::mat& U, const arma::mat& b);
+arma::mat mvrnrm_chol(int n, const arma::vec& mu, const arma::mat& U, double s = 1);
+arma::mat mnrnrm_chol(const arma::mat& M, const arma::mat& U, const arma::mat& L);
 arma::cube rinvwish(int n, int v, arma::mat S);
 double invchisq(double nu, double scale);
+arma::uword rng_seed();
+arma::mat randn_stream(arma::uword n_rows, arma::uword n_cols, rng_stream& rng);
+void randn_stream(arma::mat& X, rng_stream& rng);
+arma::mat sqrt_psd(const arma::mat& Sigma);
+void sqrt_psd(arma::mat& C, arma::vec& eigval, const arma::mat& Sigma);
+arma::mat mvrnrm(int n, arma::vec mu, arma::mat Sigma, rng_stream& rng);
+arma::mat mvrnrm_chol(int n, const arma::vec& mu, const arma::mat& U, double s, rng_stream& rng);
+arma::mat mnrnrm_chol(const arma::mat& M, const arma::mat& U, const arma::mat& L, rng_stream& rng);
+arma::cube rinvwish(int n, int v, arma::mat S, rng_stream& rng);
+double invchisq(double nu, double scale, rng_stream& rng);
+bool check_interrupt();
+bool master_thread();
+P2Quantile p2_init(arma::uword n, double p);
+void p2_add(P2Quantile& s, const arma::vec& x);
+arma::vec p2_get(const P2Quantile& s);
+arma::vec p2_merge(const std::vector<P2Quantile>& s);
+arma::vec p2_quantile(arma::mat X, double p, arma::uword sketches = 1);
 arma:: mat stack_obs(arma::mat nn, arma::uword p, arma::uword r = 0);
 
 